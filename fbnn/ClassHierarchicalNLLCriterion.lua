@@ -6,8 +6,9 @@ Hierarchical softmax classifier with two levels and arbitrary clusters.
 Note:
 This criterion does include the lower layer parameters
 (this is more `Linear` + `ClassNLLCriterion`, but hierarchical).
-Also, this layer does not support the use of mini-batches
-(only 1 sample at the time).
+Mini-batches (2D input, tensor of targets) go through a native kernel that
+groups the samples by cluster; the loss is then summed over the batch.
+`updateParameters` handles both; `infer` only handles one sample at the time.
 ]]
 local ClassHierarchicalNLLCriterion, parent = torch.class(
    'nn.ClassHierarchicalNLLCriterion', 'nn.Criterion')
@@ -62,9 +63,36 @@ function ClassHierarchicalNLLCriterion:__init(mapping, clusterCounts, inputSize)
    self.numClasses = 0
 end
 
--- `target` is the class id
+-- Buffers of the mini-batch kernels (created lazily, so that serialized
+-- criteria keep working).
+function ClassHierarchicalNLLCriterion:batchBuffers(input, target)
+   if not self.mappingLong then
+      self.mappingLong = self.mapping:long()
+      self.clusterCountsLong = self.clusterCounts:long()
+      self.startIndexLong = self.startIndex:long():add(-1) -- 0 based !
+      self.clusterScore = input.new()
+      self.clusterLogsum = input.new()
+      self.classScore = input.new()
+      self.classLogsum = input.new()
+   end
+   local batchSize = input:size(1)
+   self.clusterScore:resize(batchSize, self.clusterBias:size(1))
+   self.clusterLogsum:resize(batchSize)
+   self.classScore:resize(batchSize, self.clusterCounts:max())
+   self.classLogsum:resize(batchSize)
+   return input:contiguous(), target:long()
+end
+
+-- `target` is the class id (a tensor of class ids for a mini-batch)
 function ClassHierarchicalNLLCriterion:updateOutput(input, target)
-   assert(input:dim() == 1) -- we do not support mini-batch training
+   self.batchTarget = nil
+   if input:dim() == 2 then
+      input, target = self:batchBuffers(input, target)
+      self.output =
+         input.nn.ClassHierarchicalNLLCriterion_updateOutput(self, input,
+                                                             target)
+      return self.output
+   end
    self.clusterID = self.mapping[target][1]
    self.classID = self.mapping[target][2]
    self.startCluster = self.startIndex[self.clusterID]
@@ -100,17 +128,44 @@ function ClassHierarchicalNLLCriterion:zeroGradParametersCluster()
    self.clusterMatrixDx:zero()
 end
 
+-- Clusters of the targets of a mini-batch (each listed once).
+function ClassHierarchicalNLLCriterion:batchClusters(target)
+   local clusters, seen = {}, {}
+   for i = 1, target:size(1) do
+      local clusterID = self.mapping[target[i]][1]
+      if not seen[clusterID] then
+         seen[clusterID] = true
+         table.insert(clusters, clusterID)
+      end
+   end
+   return clusters
+end
+
 function ClassHierarchicalNLLCriterion:zeroGradParametersClass(target)
-   local clusterID = self.mapping[target][1]
-   local startCluster = self.startIndex[clusterID]
-   local numClasses = self.clusterCounts[clusterID]
-   self.classMatrixDx:narrow(1, startCluster, numClasses):zero()
-   self.classBiasDx:narrow(1, startCluster, numClasses):zero()
+   local clusters
+   if torch.isTensor(target) then
+      clusters = self:batchClusters(target)
+   else
+      clusters = {self.mapping[target][1]}
+   end
+   for _, clusterID in ipairs(clusters) do
+      local startCluster = self.startIndex[clusterID]
+      local numClasses = self.clusterCounts[clusterID]
+      self.classMatrixDx:narrow(1, startCluster, numClasses):zero()
+      self.classBiasDx:narrow(1, startCluster, numClasses):zero()
+   end
 end
 
 -- This computes derivatives w.r.t. input and parameters.
 function ClassHierarchicalNLLCriterion:updateGradInput(input, target)
-   assert(input:dim() == 1) -- we do not support mini-batch training
+   if input:dim() == 2 then
+      input, target = self:batchBuffers(input, target)
+      self.gradInput:resizeAs(input)
+      input.nn.ClassHierarchicalNLLCriterion_updateGradInput(self, input,
+                                                             target)
+      self.batchTarget = target
+      return self.gradInput
+   end
    self.gradInput:resizeAs(input)
    -- BPROP through the cluster prediction
    self.logLossCluster:updateGradInput(self.logSMCluster.output, self.clusterID)
@@ -134,8 +189,24 @@ function ClassHierarchicalNLLCriterion:updateGradInput(input, target)
    return self.gradInput
 end
 
--- Update parameters (only those that are used to process this sample).
+-- Update parameters (only those that are used to process this sample, or
+-- the last mini-batch).
 function ClassHierarchicalNLLCriterion:updateParameters(learningRate)
+   if self.batchTarget then
+      for _, clusterID in ipairs(self:batchClusters(self.batchTarget)) do
+         local startCluster = self.startIndex[clusterID]
+         local numClasses = self.clusterCounts[clusterID]
+         self.classMatrix:narrow(1, startCluster, numClasses):add(
+            -learningRate,
+            self.classMatrixDx:narrow(1, startCluster, numClasses))
+         self.classBias:narrow(1, startCluster, numClasses):add(
+            -learningRate,
+            self.classBiasDx:narrow(1, startCluster, numClasses))
+      end
+      self.clusterMatrix:add(-learningRate, self.clusterMatrixDx)
+      self.clusterBias:add(-learningRate, self.clusterBiasDx)
+      return
+   end
    self.classMatrix:narrow(1, self.startCluster, self.numClasses):add(
          -learningRate,
       self.classMatrixDx:narrow(1, self.startCluster, self.numClasses))
@@ -17,32 +17,33 @@ w4 |         | -> norm4
 ```
 
 Group K-max pooling keeps the K words with largest norm and discards the
-rest.
+rest. The norm is the ${L^p}$ norm for `p` = 1 or 2 (the default), or the max
+norm for `p` = math.huge; it is computed while the words are selected.
 ]]   
 local GroupKMaxPooling, parent =
     torch.class('nn.GroupKMaxPooling', 'nn.Module')
 
-function GroupKMaxPooling:__init(k, k_dynamic)
+function GroupKMaxPooling:__init(k, k_dynamic, p)
     parent.__init(self)
 
     self.k = k
     self.k_dynamic = k_dynamic or -1
+    self.p = p or 2
 
     self.output = torch.Tensor()
     self.gradInput = torch.Tensor()
     self.switches = torch.LongTensor()
+    -- clear gradInput by zeroing the entries written by the previous
+    -- backward (O(k) instead of O(input length)); gradInput must not be
+    -- modified outside of the module
+    self.sparse_backward = false
+    self.grad_switches = torch.LongTensor()
 end
 
 function GroupKMaxPooling:updateOutput(input)
-    if input:dim() == 2 then
-        group_norms = torch.norm(input, 2, 2)
-    else
-        group_norms = torch.norm(input, 2, 3)
-    end
-
     input = input:contiguous()
 
-    return input.nn.GroupKMaxPooling_updateOutput(self, input, group_norms)
+    return input.nn.GroupKMaxPooling_updateOutput(self, input)
 end
 
 function GroupKMaxPooling:updateGradInput(input, gradOutput)
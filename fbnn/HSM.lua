@@ -16,10 +16,14 @@ Parameters:
     * `mapping[i][1]` : index (1-based) of the cluster of class `i`
     * `mapping[i][2]` : index (1-based) of the index within its cluster of class `i`
 *  `input_size` is the number of elements of the previous layer
-*  `unk_index` is an index that is ignored at test time (not added to the
-    loss). It can be disabled by setting it to 0 (not nil).
-    It should only be used uring testing (since during training,
-    it is not disabled in the backprop (TODO) )
+*  `unk_index` is a class whose samples are skipped (not added to the loss,
+    and no gradient, CPU only). It can be disabled by setting it to 0 (not
+    nil).
+
+Samples can also be skipped by setting `ignore_mask` to a ByteTensor with
+one element per sample (non-zero to skip), which must stay the same from
+`updateOutput` to `accGradParameters`. `updateOutput` returns the loss and
+the number of samples that were not skipped.
 ]]
 function HSM:__init(mapping, input_size, unk_index)
     parent.__init(self)
@@ -54,13 +58,41 @@ function HSM:__init(mapping, input_size, unk_index)
     self.cluster_grad_bias   = torch.Tensor(self.n_clusters)
     self.class_grad_weight   = torch.Tensor(self.n_classes, input_size)
     self.class_grad_bias     = torch.Tensor(self.n_classes)
-    self.logSMCluster = nn.LogSoftMax()
-    self.logLossCluster = nn.ClassNLLCriterion()
-    self.logLossCluster.sizeAverage = false
     self.batch_size = 0
+    -- run the class stage of minibatches with one GEMM per touched cluster
+    -- (instead of one GEMV per sample)
+    self.grouped = true
+    -- Hogwild direct update: threads update the class parameters of their
+    -- slice of the batch without locking (see `accGradParameters`)
+    self.hogwild = false
+    self.hogwild_hot_clusters = 0
     self:reset()
 end
 
+--[[
+Builds a `mapping` for `nn.HSM` from the class frequencies `freqs` (a
+vector of counts or probabilities), minimizing the expected work per sample:
+the number of clusters plus the expected size of the target's cluster.
+Classes are sorted by decreasing frequency and cut into frequency-balanced
+clusters of at most `max_cluster_size` classes (default: no bound), so that
+frequent classes land in small clusters.
+
+Returns the mapping, the predicted cost (rows of size `input_size` scored
+per sample, in the forward pass) and the number of clusters.
+]]
+function HSM.buildMapping(freqs, max_cluster_size)
+    if type(freqs) == 'table' then
+        freqs = torch.DoubleTensor(freqs)
+    else
+        freqs = freqs:double()
+    end
+    max_cluster_size = max_cluster_size or freqs:size(1)
+    local mapping = torch.LongTensor()
+    local cost, n_clusters =
+        freqs.nn.HSM_buildMapping(freqs, max_cluster_size, mapping)
+    return mapping, cost, n_clusters
+end
+
 function HSM:clone(...)
     return nn.Module.clone(self, ...)
 end
@@ -116,22 +148,153 @@ function HSM:get_n_class_in_cluster(mapping)
 end
 
 function HSM:parameters()
+    if self.class_grad_offset or self.class_weight_bf16 then
+        return {self.cluster_weight, self.cluster_bias},
+        {self.cluster_grad_weight, self.cluster_grad_bias}
+    end
     return {self.cluster_weight, self.cluster_bias,
             self.class_weight, self.class_bias},
     {self.cluster_grad_weight, self.cluster_grad_bias,
      self.class_grad_weight, self.class_grad_bias}
 end
 
+--[[
+Sparse class gradients (CPU only). With `sparse` (default true), the class
+gradients are accumulated in compact buffers holding only the rows of the
+clusters touched since the last `zeroGradParameters`, so that
+`zeroGradParameters` and `updateParameters` cost O(touched rows) instead of
+O(n_classes * input_size). `class_grad_offset[c]` is the first (0 based) row
+of cluster c in `class_grad_weight`, or -1 if it was not touched.
+
+The class parameters are then not returned by `parameters()`, since their
+gradients are not dense tensors anymore: update them with
+`updateParameters`, or use `touchedClassParameters()` with a custom
+optimizer.
+]]
+function HSM:sparseClassGrad(sparse)
+    if sparse == nil then
+        sparse = true
+    end
+    local input_size = self.cluster_weight:size(2)
+    if sparse then
+        local capacity = self.n_max_class_in_cluster
+        self.class_grad_weight = self.class_weight.new(capacity, input_size)
+        self.class_grad_bias = self.class_bias.new(capacity)
+        self.class_grad_offset = torch.LongTensor(self.n_clusters):fill(-1)
+        self.touched_clusters = torch.LongTensor(self.n_clusters)
+        -- number of touched clusters, and of rows used in the buffers
+        self.n_touched = torch.LongTensor(2):zero()
+        self.class_grad_weight:zero()
+        self.class_grad_bias:zero()
+    else
+        self.class_grad_weight = self.class_weight.new(self.n_classes,
+                                                       input_size)
+        self.class_grad_bias = self.class_bias.new(self.n_classes)
+        self.class_grad_offset = nil
+        self.touched_clusters = nil
+        self.n_touched = nil
+        self.class_grad_weight:zero()
+        self.class_grad_bias:zero()
+    end
+    return self
+end
+
+-- Grows the sparse class gradient buffers so that a batch of `batch_size`
+-- samples fits, keeping the rows already accumulated.
+function HSM:reserveClassGrad(batch_size)
+    local used = self.n_touched[2]
+    local needed = math.min(self.n_classes,
+                            used + batch_size * self.n_max_class_in_cluster)
+    local capacity = self.class_grad_weight:size(1)
+    if needed <= capacity then
+        return
+    end
+    capacity = math.min(self.n_classes, math.max(needed, 2 * capacity))
+    local grad_weight = self.class_grad_weight.new(
+        capacity, self.class_grad_weight:size(2)):zero()
+    local grad_bias = self.class_grad_bias.new(capacity):zero()
+    if used > 0 then
+        grad_weight:narrow(1, 1, used):copy(
+            self.class_grad_weight:narrow(1, 1, used))
+        grad_bias:narrow(1, 1, used):copy(
+            self.class_grad_bias:narrow(1, 1, used))
+    end
+    self.class_grad_weight = grad_weight
+    self.class_grad_bias = grad_bias
+end
+
+-- In sparse mode, returns the class parameters and gradients of the
+-- clusters touched since the last `zeroGradParameters`, as lists of views.
+function HSM:touchedClassParameters()
+    assert(self.class_grad_offset, 'HSM: sparseClassGrad is not enabled')
+    assert(not self.class_weight_bf16, 'HSM: the class weights are compressed')
+    local params, grads = {}, {}
+    for i = 1, self.n_touched[1] do
+        local cluster = self.touched_clusters[i] + 1 -- 0based->1based
+        local size = self.n_class_in_cluster[cluster]
+        local start = self.class_start_indices[cluster] + 1
+        local offset = self.class_grad_offset[cluster] + 1
+        table.insert(params, self.class_weight:narrow(1, start, size))
+        table.insert(params, self.class_bias:narrow(1, start, size))
+        table.insert(grads, self.class_grad_weight:narrow(1, offset, size))
+        table.insert(grads, self.class_grad_bias:narrow(1, offset, size))
+    end
+    return params, grads
+end
+
 function HSM:getParameters()
     return nn.Module.getParameters(self)
 end
 
+--[[
+Stores the class weights as bfloat16 (the upper 16 bits of each float, CPU
+only), halving the memory and bandwidth of the largest parameter. The
+weights are kept in `class_weight_bf16`, a ByteTensor of n_classes x
+(2 * input_size) bytes, and `class_weight` is left empty; they are converted
+back to float one cluster at a time, so the results differ from the float
+module by the rounding of the weights only. The biases stay in float.
+
+Updates are computed in float and rounded into the bfloat16 weights. They
+work with `direct_update` (but not `hogwild`) or with `sparseClassGrad()`,
+which keeps the class gradients as compact as the weights; dense class
+gradients are still accumulated, but `updateParameters` refuses them.
+The class parameters are not returned by `parameters()` anymore.
+]]
+function HSM:compressClassWeight()
+    assert(self.class_weight:type() ~= 'torch.CudaTensor',
+           'HSM: compressed class weights are CPU only')
+    if not self.class_weight_bf16 then
+        self.class_weight_bf16 = torch.ByteTensor()
+        self.class_weight.nn.HSM_toBF16(self.class_weight_bf16,
+                                        self.class_weight)
+        self.class_weight = self.class_weight.new()
+    end
+    return self
+end
+
+-- Converts the bfloat16 class weights back to `class_weight`.
+function HSM:decompressClassWeight()
+    if self.class_weight_bf16 then
+        self.class_weight.nn.HSM_fromBF16(self.class_weight,
+                                          self.class_weight_bf16)
+        self.class_weight_bf16 = nil
+    end
+    return self
+end
+
 function HSM:reset(weight_stdv, bias_stdv)
     weight_stdv = weight_stdv or 0.1
     bias_stdv = bias_stdv or 0.1
     self.cluster_weight:normal():mul(weight_stdv)
     self.cluster_bias:normal():mul(bias_stdv)
-    self.class_weight:normal():mul(weight_stdv)
+    if self.class_weight_bf16 then
+        local class_weight = self.cluster_weight.new(
+            self.n_classes, self.cluster_weight:size(2))
+        class_weight:normal():mul(weight_stdv)
+        class_weight.nn.HSM_toBF16(self.class_weight_bf16, class_weight)
+    else
+        self.class_weight:normal():mul(weight_stdv)
+    end
     self.class_bias:normal():mul(bias_stdv)
 end
 
@@ -157,38 +320,13 @@ function HSM:updateOutputCPU(input, target)
     self.cluster_logsum:resize(self.batch_size)
     self.class_score:resize(self.batch_size, self.n_max_class_in_cluster)
     self.class_logsum:resize(self.batch_size)
-    -- go through the cluster softmax
-    -- linear layer
     if input:dim() == 1 then
-       self.cluster_score:resize(self.cluster_bias:size(1))
-       self.cluster_score:copy(self.cluster_bias)
-       self.cluster_score:addmv(1, self.cluster_weight, input)
-       loss = self.logLossCluster:forward(self.logSMCluster:forward(
-                                             self.cluster_score),
-                                          self.mapping[target[1]][1])
-    else
-      if self.n_clusters == 1 then
-         self.cluster_score:zero():add(self.cluster_bias[1])
-         self.cluster_score:select(2,1):addmv(1, input,
-                                              self.cluster_weight:select(1,1))
-         loss = self.logLossCluster:forward(
-            self.logSMCluster:forward(self.cluster_score),
-            torch.Tensor{self.mapping[target[1]][1]})
-      else
-         self.cluster_score:zero():addr(1, self.tmp_ones, self.cluster_bias)
-         self.cluster_score:addmm(1, input, self.cluster_weight:t())
-         loss = self.logLossCluster:forward(
-            self.logSMCluster:forward(self.cluster_score),
-            self.mapping:index(1, target):select(2,1))
-      end
+        self.cluster_score:resize(self.n_clusters)
     end
-
+    -- the cluster softmax and the class stage are both computed natively
     local n_valid
     self.output, n_valid = input.nn.HSM_updateOutputWithTarget(self, input,
                                                                target)
-    n_valid = self.batch_size --TODO
-    assert(self.unk_index == 0)
-    self.output = self.output + loss
     return self.output, n_valid
 end
 
@@ -222,6 +360,28 @@ function HSM:updateOutputCUDA(input, target)
     return self.output, self.batch_size
 end
 
+-- Returns the `k` most likely classes of each sample (1-based indices into
+-- the mapping) and their log-probabilities, in decreasing order, without
+-- materializing the full distribution (CPU only).
+function HSM:topk(input, k)
+    if not self.class_of_row then
+        -- class of each row of `class_weight`
+        self.class_of_row = torch.LongTensor(self.n_classes)
+        for i = 1, self.n_classes do
+            local cluster = self.mapping[i][1]
+            local row = self.class_start_indices[cluster] + self.mapping[i][2]
+            self.class_of_row[row] = i
+        end
+    end
+    self.topk_index = self.topk_index or torch.LongTensor()
+    if not self.topk_logprob or self.topk_logprob:type() ~= input:type() then
+        self.topk_logprob = input.new()
+    end
+    input.nn.HSM_topK(self, input:contiguous(), k, self.topk_index,
+                      self.topk_logprob)
+    return self.topk_index, self.topk_logprob
+end
+
 -- Note: call this function at most once after each call `updateOutput`,
 -- or the output will be wrong (it uses `class_score` and `cluster_score`
 -- as temporary buffers)
@@ -234,26 +394,9 @@ function HSM:updateGradInput(input, target)
 end
 
 function HSM:updateGradInputCPU(input, target)
-    if self.unk_index ~= 0 then
-        error("HSM: bprop with unk is not implemented")
-    end
     self.gradInput:resizeAs(input)
-    -- BPROP through the cluster prediction
-    local clusterID = self.mapping:index(1, target):select(2,1)
-    if input:dim() == 1 then
-       clusterID = clusterID[1]
-    end
-    self.logLossCluster:updateGradInput(self.logSMCluster.output,
-                                        clusterID)
-    self.logSMCluster:updateGradInput(self.cluster_score,
-                                      self.logLossCluster.gradInput)
-    if input:dim() == 1 then
-       self.gradInput:addmv(
-          0, 1, self.cluster_weight:t(), self.logSMCluster.gradInput)
-    else
-       self.gradInput:addmm(
-          0, 1, self.logSMCluster.gradInput, self.cluster_weight)
-    end
+    -- BPROP through the cluster and class predictions (this leaves the
+    -- gradient wrt the cluster scores in `cluster_score`)
     input.nn.HSM_updateGradInput(self, target)
     return self.gradInput
 end
@@ -270,17 +413,16 @@ end
 -- gradients). It means that the gradient tensors (like `cluster_grad_weight`)
 -- are not used. scale must be set to the negative learning rate
 -- (`-learning_rate`). `direct_update` mode is much faster.
+-- With `self.hogwild` set, the direct update of the class parameters is done
+-- Hogwild-style: the threads take disjoint slices of the batch and update
+-- the shared cluster slices without locks, so the result is not
+-- deterministic. The `self.hogwild_hot_clusters` clusters with the most
+-- samples in the batch are still updated by a single thread each.
 -- Before calling this function you have to call `HSM:updateGradInput` first.
 function HSM:accGradParameters(input, target, scale, direct_update)
     scale = scale or 1
-    if self.unk_index ~= 0 then
-        error("HSM: bprop with unk is not implemented")
-    end
 
-    local cluster_gradInput = self.logSMCluster.gradInput
-    if input:type() == 'torch.CudaTensor' then
-        cluster_gradInput = self.cluster_score
-    end
+    local cluster_gradInput = self.cluster_score
 
     if direct_update then
        if input:dim() == 1 then
@@ -316,6 +458,9 @@ function HSM:accGradParameters(input, target, scale, direct_update)
                                           self.tmp_ones)
           end
        end
+       if self.class_grad_offset then
+          self:reserveClassGrad(input:dim() == 1 and 1 or input:size(1))
+       end
        input.nn.HSM_accGradParameters(self, input, target, scale)
     end
 end
@@ -329,6 +474,14 @@ end
 function HSM:updateParameters(learning_rate)
     self.cluster_weight:add(-learning_rate, self.cluster_grad_weight)
     self.cluster_bias  :add(-learning_rate, self.cluster_grad_bias  )
+    if self.class_grad_offset then
+        self.class_weight.nn.HSM_updateParametersTouched(self, learning_rate)
+        return
+    end
+    if self.class_weight_bf16 then
+        error('HSM: compressed class weights need sparseClassGrad() '
+                  .. 'or direct_update')
+    end
     self.class_weight  :add(-learning_rate, self.class_grad_weight  )
     self.class_bias    :add(-learning_rate, self.class_grad_bias    )
 end
@@ -336,10 +489,18 @@ end
 function HSM:zeroGradParameters()
     self.cluster_grad_weight:zero()
     self.cluster_grad_bias:zero()
+    if self.class_grad_offset then
+        self.class_weight.nn.HSM_zeroGradParametersTouched(self)
+        return
+    end
     self.class_grad_weight:zero()
     self.class_grad_bias:zero()
 end
 
 function HSM:zeroGradParametersClass(input, target)
+   if self.class_grad_offset then
+      input.nn.HSM_zeroGradParametersTouched(self)
+      return
+   end
    input.nn.HSM_zeroGradParametersClass(self, target)
 end
@@ -12,16 +12,27 @@ function KMaxPooling:__init(k, k_dynamic)
     self.output = torch.Tensor()
     self.gradInput = torch.Tensor()
     self.switches = torch.LongTensor()
+    -- clear gradInput by zeroing the entries written by the previous
+    -- backward (O(k) instead of O(input length)); gradInput must not be
+    -- modified outside of the module
+    self.sparse_backward = false
+    self.grad_switches = torch.LongTensor()
+    self.grad_length = torch.LongTensor()
 end
 
+-- `input` is a sentence (length x features), or a batch of sentences
+-- (batch x length x features) pooled in parallel. `input_info.length` holds
+-- the length of each sentence (by default, the full length); rows past it
+-- are ignored, and the output has k rows per sentence.
 function KMaxPooling:updateOutput(input, input_info)
     input = input:contiguous()
 
     local return_info = true
 
     if input_info == nil then
-        input_length = torch.LongTensor(1)
-        input_length[1] = input:size(1)
+        local batch_size = input:dim() == 3 and input:size(1) or 1
+        local input_length = torch.LongTensor(batch_size)
+        input_length:fill(input:size(input:dim() - 1))
 
         input_info = { length = input_length }
 
@@ -0,0 +1,151 @@
+-- Copyright 2004-present Facebook. All Rights Reserved.
+
+require 'math'
+require 'nn'
+
+-- Sampled softmax (or NCE) over a flat class weight matrix, for training
+-- with large vocabularies (CPU only).
+local SampledSoftMax, parent =
+    torch.class('nn.SampledSoftMax', 'nn.Criterion')
+
+--[[
+Parameters:
+* `n_classes` is the number of classes
+* `input_size` is the number of elements of the previous layer
+* `n_samples` is the number of negative classes drawn for each batch, and
+    shared by all of its samples
+* `sampler` is either 'log_uniform' (the default: class `c` is drawn with
+    probability log((c + 1) / c) / log(n_classes + 1), which assumes the
+    classes are sorted by decreasing frequency), or a tensor of
+    `n_classes` class counts or frequencies (unigram sampler)
+
+Each sample scores its target and the `n_samples` sampled classes, whose
+logits are corrected by the log of their expected count in the samples
+(sampled classes equal to the target are left out). The loss is the
+cross-entropy over these logits, or with `nce` set, the logistic loss of
+noise-contrastive estimation. It is not the exact negative log-likelihood,
+so use the full softmax (`weight` and `bias` hold a `nn.Linear`-style
+layer) for evaluation.
+
+`weight` and `bias` follow the layout of the class parameters of `nn.HSM`.
+Their gradients are only accumulated in the rows of the targets and of the
+sampled classes, and `zeroGradParameters` and `updateParameters` only
+visit these rows.
+]]
+function SampledSoftMax:__init(n_classes, input_size, n_samples, sampler)
+    parent.__init(self)
+    self.n_classes = n_classes
+    self.n_samples = n_samples
+    self.weight        = torch.Tensor(n_classes, input_size)
+    self.bias          = torch.Tensor(n_classes)
+    self.grad_weight   = torch.Tensor(n_classes, input_size):zero()
+    self.grad_bias     = torch.Tensor(n_classes):zero()
+    self.score         = torch.Tensor()
+    self.logsum        = torch.Tensor()
+    self.sample_weight = torch.Tensor()
+    self.gradInput     = torch.Tensor(input_size)
+    -- rows (1-based) with a non-zero gradient
+    self.touched_rows = torch.LongTensor(n_classes)
+    self.row_touched  = torch.ByteTensor(n_classes):zero()
+    self.n_touched    = torch.LongTensor(1):zero()
+    -- negative classes of the current batch
+    self.sample_ids = torch.LongTensor(n_samples)
+    self.nce = false
+    -- draw new samples at each `updateOutput`
+    self.resample = true
+    self:setSampler(sampler or 'log_uniform')
+    self:reset()
+end
+
+-- Sets the sampler (see `__init`), and `log_prob`, the log-probability of
+-- drawing each class.
+function SampledSoftMax:setSampler(sampler)
+    local n = self.n_classes
+    if sampler == 'log_uniform' then
+        self.sampler = sampler
+        self.sample_prob = nil
+        local c = torch.range(1, n)
+        self.log_prob = torch.log(torch.log(torch.cdiv(c + 1, c)))
+        self.log_prob:add(-math.log(math.log(n + 1)))
+    else
+        assert(sampler:nElement() == n,
+               'SampledSoftMax: sampler needs one count per class')
+        self.sampler = 'unigram'
+        self.sample_prob = sampler:double():clone()
+        self.sample_prob:div(self.sample_prob:sum())
+        -- classes that are never sampled can still be targets
+        self.log_prob = torch.log(self.sample_prob:clone():clamp(1e-12, 1))
+    end
+    self.log_prob = self.log_prob:typeAs(self.weight)
+end
+
+-- Draws the negative classes of the next batch into `sample_ids`.
+function SampledSoftMax:drawSamples()
+    if self.sampler == 'log_uniform' then
+        local log_n = math.log(self.n_classes + 1)
+        local draws = torch.rand(self.n_samples):mul(log_n):exp():floor()
+        self.sample_ids:copy(draws:clamp(1, self.n_classes))
+    else
+        self.sample_ids = torch.multinomial(self.sample_prob, self.n_samples,
+                                            true)
+    end
+    return self.sample_ids
+end
+
+function SampledSoftMax:parameters()
+    return {self.weight, self.bias}, {self.grad_weight, self.grad_bias}
+end
+
+function SampledSoftMax:getParameters()
+    return nn.Module.getParameters(self)
+end
+
+function SampledSoftMax:reset(weight_stdv, bias_stdv)
+    weight_stdv = weight_stdv or 0.1
+    bias_stdv = bias_stdv or 0.1
+    self.weight:normal():mul(weight_stdv)
+    self.bias:normal():mul(bias_stdv)
+end
+
+function SampledSoftMax:updateOutput(input, target)
+    if input:dim() ~= 1 then -- minibatch
+        assert(input:dim() == 2)
+    end
+    if self.resample then
+        self:drawSamples()
+    end
+    self.input = input:contiguous()
+    self.output = input.nn.SampledSoftMax_updateOutput(self, self.input,
+                                                       target)
+    return self.output
+end
+
+-- Note: call this function at most once after each call `updateOutput`
+-- (it turns `score` into the gradient wrt the logits)
+function SampledSoftMax:updateGradInput(input, target)
+    self.gradInput:resizeAs(input)
+    input.nn.SampledSoftMax_updateGradInput(self, target)
+    return self.gradInput
+end
+
+-- If `direct_update` is set, the parameters are directly updated (not the
+-- gradients), and scale must be set to the negative learning rate.
+function SampledSoftMax:accGradParameters(input, target, scale, direct_update)
+    input.nn.SampledSoftMax_accGradParameters(self, self.input, target,
+                                              scale or 1,
+                                              direct_update or false)
+end
+
+function SampledSoftMax:backward(input, target, scale)
+    self:updateGradInput(input, target)
+    self:accGradParameters(input, target, scale)
+    return self.gradInput
+end
+
+function SampledSoftMax:updateParameters(learning_rate)
+    self.weight.nn.SampledSoftMax_updateParameters(self, learning_rate)
+end
+
+function SampledSoftMax:zeroGradParameters()
+    self.weight.nn.SampledSoftMax_zeroGradParameters(self)
+end
@@ -27,16 +27,32 @@ local function softplus(x)
 end
 
 function SoftPlusLSECriterion:updateOutput(input)
-    local max_val = torch.max(input, 2)
-    input = input - max_val:expand(input:size())
-    self.LSE = input:exp():sum(2):log()
-    self.LSE:add(max_val)
+    if input.nn.LogSumExp_rows then
+        -- the buffers follow the type of the input, as on the Lua path
+        if self.LSE:type() ~= input:type() then
+            self.LSE = input.new()
+        end
+        input.nn.LogSumExp_rows(self.LSE, input:contiguous())
+    else
+        local max_val = torch.max(input, 2)
+        input = input - max_val:expand(input:size())
+        self.LSE = input:exp():sum(2):log()
+        self.LSE:add(max_val)
+    end
     self.LSE:apply(softplus)
     self.output = self.LSE:sum()
      return self.output
 end
 
 function SoftPlusLSECriterion:updateGradInput(input)
-    self.gradInput = torch.exp(input - self.LSE:expand(input:size()))
+    if input.nn.LogSumExp_expShiftedRows then
+        if self.gradInput:type() ~= input:type() then
+            self.gradInput = input.new()
+        end
+        input.nn.LogSumExp_expShiftedRows(self.gradInput, input:contiguous(),
+                                          self.LSE)
+    else
+        self.gradInput = torch.exp(input - self.LSE:expand(input:size()))
+    end
     return self.gradInput
 end
@@ -26,10 +26,18 @@ local function softplus(x)
 end
 
 function SoftPlusLSEMinusLSECriterion:updateOutput(input)
-    local max_val = torch.max(input, 2)
-    input = input - max_val:expand(input:size())
-    self.LSE = input:exp():sum(2):log()
-    self.LSE:add(max_val)
+    if input.nn.LogSumExp_rows then
+        -- the buffers follow the type of the input, as on the Lua path
+        if self.LSE:type() ~= input:type() then
+            self.LSE = input.new()
+        end
+        input.nn.LogSumExp_rows(self.LSE, input:contiguous())
+    else
+        local max_val = torch.max(input, 2)
+        input = input - max_val:expand(input:size())
+        self.LSE = input:exp():sum(2):log()
+        self.LSE:add(max_val)
+    end
     self.SoftPlusLSE = self.LSE:clone()
     self.SoftPlusLSE:apply(softplus)
     self.output = (self.SoftPlusLSE - self.LSE):sum()
@@ -37,7 +45,20 @@ function SoftPlusLSEMinusLSECriterion:updateOutput(input)
 end
 
 function SoftPlusLSEMinusLSECriterion:updateGradInput(input)
-    self.gradInput = torch.exp(input - self.SoftPlusLSE:expand(input:size()))
-    self.gradInput:add(-torch.exp(input - self.LSE:expand(input:size())))
+    if input.nn.LogSumExp_softMaxRows then
+        -- exp(x - SoftPlusLSE) - exp(x - LSE)
+        --     = softmax(x) * (exp(LSE - SoftPlusLSE) - 1)
+        input = input:contiguous()
+        if self.gradInput:type() ~= input:type() then
+            self.gradInput = input.new()
+        end
+        input.nn.LogSumExp_softMaxRows(self.gradInput, input)
+        local scale = torch.exp(self.LSE - self.SoftPlusLSE):add(-1)
+        self.gradInput:cmul(scale:expandAs(self.gradInput))
+    else
+        self.gradInput =
+            torch.exp(input - self.SoftPlusLSE:expand(input:size()))
+        self.gradInput:add(-torch.exp(input - self.LSE:expand(input:size())))
+    end
     return self.gradInput
 end
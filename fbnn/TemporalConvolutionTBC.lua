@@ -6,22 +6,168 @@
 
 local TBC, parent = torch.class('nn.TemporalConvolutionTBC', 'nn.Module')
 
-function TBC:__init(nIn, nOut, kw,pad)
+-- activation ids of the kernels
+local activations = {relu = 1, glu = 2}
+
+-- `activation` ('relu' or 'glu', over the channels) and `residual` (add the
+-- input to the output, which needs nIn == nOut and an output as long as the
+-- input) are optional epilogues, fused with the convolution. With 'glu',
+-- the convolution has 2 * nOut output planes.
+-- Output frame t reads the input frames t * stride - pad + k * dilation,
+-- for k = 0 .. kw - 1 (stride and dilation are 1 by default).
+function TBC:__init(nIn, nOut, kw, pad, activation, residual, stride,
+                    dilation)
   pad = pad or 0
   parent.__init(self)
+  assert(activation == nil or activations[activation],
+         'unknown activation')
+  assert(not residual or nIn == nOut, 'residual needs nIn == nOut')
 
   self.kw = kw
   self.pad = pad
+  self.stride = stride or 1
+  self.dilation = dilation or 1
   self.nIn = nIn
   self.nOut = nOut
+  self.activation = activation
+  self.residual = residual or false
 
-  self.weight = torch.Tensor(kw,nIn,nOut)
-  self.bias = torch.Tensor(nOut)
-  self.gradWeight = torch.Tensor(kw,nIn,nOut)
-  self.gradBias = torch.Tensor(nOut)
+  local convOut = activation == 'glu' and 2 * nOut or nOut
+  self.weight = torch.Tensor(kw,nIn,convOut)
+  self.bias = torch.Tensor(convOut)
+  self.gradWeight = torch.Tensor(kw,nIn,convOut)
+  self.gradBias = torch.Tensor(convOut)
+  -- convolution output and its gradient, with an activation
+  self.preactivation = torch.Tensor()
+  self.grad_preactivation = torch.Tensor()
+  -- time-unfolded input, for computing each pass with a single gemm; set
+  -- self.unfold to true or false to force or disable it (by default, the
+  -- faster way is measured for each shape)
+  self.unfolded = torch.Tensor()
+  -- weight taps packed for the BLAS library, in evaluation mode (MKL only),
+  -- and the weight they come from
+  self.packed_weight = torch.Tensor()
+  self.packed_key = torch.LongTensor()
   self:reset()
 end
 
+-- Drops the packed weight of the evaluation mode, e.g. to free it. The
+-- kernels repack it when the weight tensor is replaced or any of its
+-- entries changed, and evaluate(), reset() and type() drop it.
+function TBC:clearPackedWeight()
+  if self.packed_key then
+    self.packed_key:set()
+    self.packed_weight:set()
+  end
+end
+
+-- Sets the lengths of the sequences of the batch (a LongTensor with one
+-- length per batch element, or nil): the frames past the length of a
+-- sequence are then padding, which costs nothing in forward and backward;
+-- the output frames past its output length are zero (before the epilogue),
+-- and their gradient is ignored. Not used by updateOutputIncremental.
+function TBC:setInputLengths(lengths)
+  self.input_lengths = lengths and lengths:long()
+  return self
+end
+
+-- Returns the output lengths of the sequences of the given lengths, e.g.
+-- for the input lengths of the next layer
+function TBC:outputLengths(lengths)
+  local stride, dilation = self.stride or 1, self.dilation or 1
+  local extra = 2 * self.pad - (self.kw - 1) * dilation
+  return lengths:long():clone():apply(function(length)
+    local span = length + extra
+    return span >= 1 and math.floor((span - 1) / stride) + 1 or 0
+  end)
+end
+
+-- Int8 inference (CPU only): stores the weight as int8 with one scale per
+-- output plane. In evaluation mode, updateOutput and updateOutputIncremental
+-- then quantize the input to int8 with a single scale (max |input|, or the
+-- one set by calibrate()) and accumulate the products in int32; the bias is
+-- added in float. The float weight is kept for training; call quantize()
+-- again after changing it.
+function TBC:quantize()
+  assert(self.weight:type() ~= 'torch.CudaTensor',
+         'int8 inference is CPU only')
+  self.quantized_weight = torch.ByteTensor()
+  self.weight_scales = self.weight.new()
+  self.quantized_input = torch.ByteTensor()
+  self.weight.nn.TemporalConvolutionTBC_quantize(self)
+  return self
+end
+
+function TBC:dequantize()
+  self.quantized_weight = nil
+  self.weight_scales = nil
+  self.quantized_input = nil
+  self.input_scale = nil
+  return self
+end
+
+-- Sets the input scale of the int8 path from sample inputs (a tensor or a
+-- table of tensors), so that it is not measured at each forward; larger
+-- inputs are clipped. Returns the largest error of the int8 output on the
+-- samples, relative to the largest float output.
+function TBC:calibrate(inputs)
+  assert(self.quantized_weight, 'call quantize() first')
+  if torch.isTensor(inputs) then
+    inputs = {inputs}
+  end
+  local maxAbs = 0
+  for _, input in ipairs(inputs) do
+    maxAbs = math.max(maxAbs, torch.abs(input):max())
+  end
+  self.input_scale = maxAbs > 0 and maxAbs / 127 or 1
+
+  local train = self.train
+  local err = 0
+  for _, input in ipairs(inputs) do
+    self.train = true
+    local expected = self:updateOutput(input):clone()
+    self.train = false
+    local delta = torch.add(self:updateOutput(input), -1, expected)
+    err = math.max(err, delta:abs():max() /
+                          math.max(torch.abs(expected):max(), 1e-12))
+  end
+  self.train = train
+  return err
+end
+
+-- In evaluation mode the weight is packed for the BLAS library (MKL only)
+-- at the first forward. Each forward hashes the weight to repack it after
+-- in-place changes (params:copy(saved) after getParameters(), loading a
+-- checkpoint into the module).
+function TBC:evaluate()
+  self:clearPackedWeight()
+  return parent.evaluate(self)
+end
+
+function TBC:training()
+  self:clearPackedWeight()
+  return parent.training(self)
+end
+
+function TBC:type(type, tensorCache)
+  self:clearPackedWeight()
+  -- keep the lengths, the key and the int8 tensors
+  local kept = {}
+  for _, name in ipairs{'input_lengths', 'quantized_weight',
+                        'quantized_input'} do
+    kept[name] = self[name]
+    self[name] = nil
+  end
+  parent.type(self, type, tensorCache)
+  for name, tensor in pairs(kept) do
+    self[name] = tensor
+  end
+  if self.packed_key then
+    self.packed_key = torch.LongTensor()
+  end
+  return self
+end
+
 function TBC:reset(stdv)
   if stdv then
     stdv = stdv * math.sqrt(3)
@@ -30,6 +176,10 @@ function TBC:reset(stdv)
   end
   self.weight:uniform(-stdv, stdv)
   self.bias:uniform(-stdv, stdv)
+  self:clearPackedWeight()
+  if self.quantized_weight then
+    self:quantize()
+  end
 end
 
 function TBC:noBias()
@@ -40,27 +190,79 @@ function TBC:updateOutput(input)
   local s = input:size()
   assert(s:size() == 3)
   assert(s[3] == self.nIn)
-  self.output:resize(s[1]-self.kw+1+2*self.pad, s[2], self.nOut)
-  input.nn.TemporalConvolutionTBC_updateOutput(self,input)
+  local stride, dilation = self.stride or 1, self.dilation or 1
+  local span = s[1] + 2 * self.pad - (self.kw - 1) * dilation
+  assert(span >= 1, 'input is too short')
+  self.output:resize(math.floor((span - 1) / stride) + 1, s[2], self.nOut)
+  input.nn.TemporalConvolutionTBC_updateOutput(self,input,
+                                               self:epilogue())
   return self.output
 end
 
+-- Returns the activation id and residual flag of the kernels
+function TBC:epilogue()
+  return activations[self.activation] or 0, self.residual or false
+end
+
+-- Incremental forward for autoregressive decoding: input holds the next
+-- frames (one or a few) of the sequence, and the output is the same frames
+-- of the causal convolution, as given by updateOutput with
+-- pad = (kw - 1) * dilation on the whole sequence so far (minus its last
+-- frames). The previous (kw - 1) * dilation input frames are kept in
+-- input_buffer; call resetIncrementalState() before a new sequence.
+-- Needs stride 1.
+function TBC:updateOutputIncremental(input)
+  local s = input:size()
+  assert(s:size() == 3)
+  assert(s[3] == self.nIn)
+  assert((self.stride or 1) == 1, 'incremental forward needs stride 1')
+  self.input_buffer = self.input_buffer or input.new()
+  self.output:resize(s[1], s[2], self.nOut)
+  input.nn.TemporalConvolutionTBC_updateOutputIncremental(
+    self, input:contiguous(), self:epilogue())
+  return self.output
+end
+
+function TBC:resetIncrementalState()
+  if self.input_buffer then
+    self.input_buffer:set()
+  end
+end
+
 function TBC:updateGradInput(input, gradOutput)
-  self.gradInput:resizeAs(input):zero()
-  input.nn.TemporalConvolutionTBC_updateGradInput(self,gradOutput)
+  if self.residual then
+    self.gradInput:resizeAs(input):copy(gradOutput)
+  else
+    self.gradInput:resizeAs(input):zero()
+  end
+  input.nn.TemporalConvolutionTBC_updateGradInput(self,gradOutput,
+                                                  self:epilogue())
   return self.gradInput
 end
 
-function TBC:accGradParameters(input, gradOutput, scale)
+-- `gradReady` tells that the gradient wrt the convolution output was
+-- computed for gradOutput by the last updateGradInput
+function TBC:accGradParameters(input, gradOutput, scale, gradReady)
   scale = scale or 1
+  local activation, residual = self:epilogue()
   input.nn.TemporalConvolutionTBC_accGradParameters(
-    self,input,gradOutput,scale)
+    self,input,gradOutput,scale,activation,residual,gradReady or false)
+end
+
+function TBC:backward(input, gradOutput, scale)
+  self:updateGradInput(input, gradOutput)
+  self:accGradParameters(input, gradOutput, scale, true)
+  return self.gradInput
 end
 
 -- we do not need to accumulate parameters when sharing
 TBC.sharedAccUpdateGradParameters = TBC.accUpdateGradParameters
 
 function TBC:clearState()
+  self:resetIncrementalState()
+  self:clearPackedWeight()
+  nn.utils.clear(self, 'unfolded', 'preactivation', 'grad_preactivation',
+                 'quantized_input')
   return parent.clearState(self)
 end
 
@@ -126,7 +328,39 @@ function TBC:test()
     assert(tensoreq(conv.gradInput, tbc.gradInput, epsilon))
   end
 
+  -- accuracy and speed of the int8 path against the float one
+  local function benchmarkquantized(bsz, l, nIn, nOut, kw, pad, iterations)
+    bsz = bsz or 64
+    l = l or 25
+    nIn = nIn or 512
+    nOut = nOut or 512
+    kw = kw or 3
+    pad = pad or 1
+    iterations = iterations or 10
+    local input = torch.randn(l, bsz, nIn):float()
+    local tbc = nn.TemporalConvolutionTBC(nIn, nOut, kw, pad):float()
+    tbc:evaluate()
+    local function time()
+      tbc:forward(input)
+      local timer = torch.Timer()
+      for _ = 1, iterations do
+        tbc:forward(input)
+      end
+      return timer:time().real / iterations
+    end
+    local float = time()
+    local expected = tbc.output:clone()
+    tbc:quantize()
+    local int8 = time()
+    local err = torch.add(tbc.output, -1, expected):abs():max() /
+      torch.abs(expected):max()
+    print(string.format('float %.3f ms, int8 %.3f ms, relative error %g',
+                        float * 1000, int8 * 1000, err))
+    return err, float, int8
+  end
+
   return {
     checkforwardbackward = checkforwardbackward,
+    benchmarkquantized = benchmarkquantized,
   }
 end
@@ -0,0 +1,174 @@
+-- Copyright 2004-present Facebook. All Rights Reserved.
+
+require 'math'
+require 'nn'
+
+-- Hierarchical soft max over a tree of arbitrary depth, with minibatches.
+local TreeHSM, parent =
+    torch.class('nn.TreeHSM', 'nn.Criterion')
+
+--[[
+Parameters:
+* `tree` is a table (or tensor) with `n_classes + n_internal` elements,
+    following the `mapping` convention of `nn.HSM` (internal nodes play the
+    role of the clusters). Elements 1 .. `n_classes` are the classes, and
+    element `n_classes + j` is the internal node `j`.
+    * `tree[i][1]` : index (1-based) of the internal node parent of node
+      `i`, or 0 if its parent is the root
+    * `tree[i][2]` : index (1-based) of node `i` within the children of its
+      parent
+    `nn.TreeHSM.fromMapping(mapping)` builds the two-level tree of an
+    `nn.HSM` mapping.
+*  `input_size` is the number of elements of the previous layer
+
+Each node but the root has a row in `weight` and `bias`, and the children of
+an internal node have contiguous rows, so a sample costs
+O(depth x branching) instead of O(n_classes).
+]]
+function TreeHSM:__init(tree, input_size)
+    parent.__init(self)
+    if type(tree) == 'table' then
+        self.tree = torch.LongTensor(tree)
+    else
+        self.tree = tree:long()
+    end
+    local n_nodes = self.tree:size(1)
+    self.n_internal = self.tree:select(2, 1):max()
+    self.n_classes = n_nodes - self.n_internal
+    self:check_tree(self.tree)
+    self.weight      = torch.Tensor(n_nodes, input_size)
+    self.bias        = torch.Tensor(n_nodes)
+    self.grad_weight = torch.Tensor(n_nodes, input_size)
+    self.grad_bias   = torch.Tensor(n_nodes)
+    self.node_score  = torch.Tensor()
+    self.node_logsum = torch.Tensor()
+    self.gradInput   = torch.Tensor(input_size)
+    self:reset()
+end
+
+-- Two-level tree equivalent to the `nn.HSM` mapping `mapping`: the clusters
+-- are the internal nodes.
+function TreeHSM.fromMapping(mapping)
+    if type(mapping) == 'table' then
+        mapping = torch.LongTensor(mapping)
+    end
+    local n_clusters = mapping:select(2, 1):max()
+    local tree = torch.LongTensor(mapping:size(1) + n_clusters, 2)
+    tree:narrow(1, 1, mapping:size(1)):copy(mapping)
+    for c = 1, n_clusters do
+        tree[mapping:size(1) + c][1] = 0
+        tree[mapping:size(1) + c][2] = c
+    end
+    return tree
+end
+
+-- Checks the tree, and computes `n_children`, `child_start` (0-based first
+-- row of the children of each internal node), `max_depth` and
+-- `max_branching`. Index 1 of `n_children` and `child_start` is the root.
+function TreeHSM:check_tree(tree)
+    local n_nodes = tree:size(1)
+    self.n_children = torch.LongTensor(self.n_internal + 1):zero()
+    for i = 1, n_nodes do
+        local p = tree[i][1]
+        if p < 0 then
+            error('TreeHSM: bad tree: negative parent for node ' .. i)
+        end
+        self.n_children[p + 1] = self.n_children[p + 1] + 1
+    end
+    for p = 1, self.n_internal + 1 do
+        if self.n_children[p] == 0 then
+            error('TreeHSM: bad tree: internal node ' .. (p - 1)
+                      .. ' has no children')
+        end
+    end
+    local seen = {}
+    for i = 1, n_nodes do
+        local p, offset = tree[i][1], tree[i][2]
+        if offset < 1 or offset > self.n_children[p + 1] then
+            error('TreeHSM: bad tree: children of ' .. p
+                      .. ' are not contiguous (node ' .. i .. ')')
+        end
+        local key = p * n_nodes + offset
+        if seen[key] then
+            error('TreeHSM: bad tree: in node ' .. p .. ', index '
+                      .. offset .. ' is used twice')
+        end
+        seen[key] = true
+    end
+    self.child_start = torch.LongTensor(self.n_internal + 1):fill(0)
+    for p = 2, self.n_internal + 1 do
+        self.child_start[p] = self.child_start[p - 1] + self.n_children[p - 1]
+    end
+    self.max_branching = self.n_children:max()
+    self.max_depth = 0
+    for i = 1, self.n_classes do
+        local depth, node = 1, i
+        while tree[node][1] ~= 0 do
+            node = self.n_classes + tree[node][1]
+            depth = depth + 1
+            if depth > self.n_internal + 1 then
+                error('TreeHSM: bad tree: cycle above class ' .. i)
+            end
+        end
+        self.max_depth = math.max(self.max_depth, depth)
+    end
+end
+
+function TreeHSM:parameters()
+    return {self.weight, self.bias}, {self.grad_weight, self.grad_bias}
+end
+
+function TreeHSM:getParameters()
+    return nn.Module.getParameters(self)
+end
+
+function TreeHSM:reset(weight_stdv, bias_stdv)
+    weight_stdv = weight_stdv or 0.1
+    bias_stdv = bias_stdv or 0.1
+    self.weight:normal():mul(weight_stdv)
+    self.bias:normal():mul(bias_stdv)
+end
+
+function TreeHSM:updateOutput(input, target)
+    local batch_size = input:size(1)
+    if input:dim() == 1 then
+        batch_size = 1
+    else -- minibatch
+        assert(input:dim() == 2)
+    end
+    self.node_score:resize(batch_size, self.max_depth, self.max_branching)
+    self.node_logsum:resize(batch_size, self.max_depth)
+    self.output = input.nn.TreeHSM_updateOutput(self, input, target)
+    return self.output
+end
+
+-- Note: call this function at most once after each call `updateOutput`
+-- (it turns `node_score` into the gradient wrt the scores)
+function TreeHSM:updateGradInput(input, target)
+    self.gradInput:resizeAs(input)
+    input.nn.TreeHSM_updateGradInput(self, target)
+    return self.gradInput
+end
+
+-- If `direct_update` is set, the parameters are directly updated (not the
+-- gradients), and scale must be set to the negative learning rate.
+function TreeHSM:accGradParameters(input, target, scale, direct_update)
+    input.nn.TreeHSM_accGradParameters(self, input, target, scale or 1,
+                                       direct_update or false)
+end
+
+function TreeHSM:backward(input, target, scale)
+    self:updateGradInput(input, target)
+    self:accGradParameters(input, target, scale)
+    return self.gradInput
+end
+
+function TreeHSM:updateParameters(learning_rate)
+    self.weight:add(-learning_rate, self.grad_weight)
+    self.bias  :add(-learning_rate, self.grad_bias  )
+end
+
+function TreeHSM:zeroGradParameters()
+    self.grad_weight:zero()
+    self.grad_bias:zero()
+end
@@ -1,5 +1,15 @@
 local UTC, parent = torch.class('nn.UnfoldedTemporalConvolution', 'nn.Module')
 
+--[[
+Temporal convolution as a linear layer over the unfolded input (kw frames
+per output frame), with `pad` zero frames on each side of every sequence.
+
+With float and double tensors, the native kernels unfold `tile_rows` output
+frames at a time (256 by default) into `unfolded_tile` and run one gemm per
+tile, instead of materializing the kw-times larger unfolded input. Other
+tensor types go through the internal nn.Linear.
+]]
+
 function UTC:__init(nin, nout, kw, dW, pad)
     dW = dW or 1
     assert(dW == 1, "nn.UnfoldedTemporalConvolution only supports dW = 1")
@@ -20,7 +30,8 @@ function UTC:__init(nin, nout, kw, dW, pad)
     self.gradWeight = self.linear.gradWeight
     self.gradBias = self.linear.gradBias
 
-    -- internal buffer
+    -- internal buffers
+    self.unfolded_tile = torch.Tensor()
     self._paddedInput = torch.Tensor()
     self._paddedGradInput = torch.Tensor()
     self._unfoldedInput = torch.Tensor()
@@ -53,6 +64,13 @@ function UTC:updateOutput(input)
         return self.output
     end
 
+    if input.nn.UnfoldedTemporalConvolution_updateOutput then
+        self.unfolded_tile = self.unfolded_tile or input.new()
+        input.nn.UnfoldedTemporalConvolution_updateOutput(
+            self, input:contiguous())
+        return self.output
+    end
+
     -- pad
     -- this a bit complicated but
     -- we want padding at beginning, end and between examples = (bsz + 1) pads
@@ -100,6 +118,12 @@ function UTC:updateGradInput(input, gradOutput)
         return self.gradInput
     end
 
+    if input.nn.UnfoldedTemporalConvolution_updateGradInput then
+        input.nn.UnfoldedTemporalConvolution_updateGradInput(
+            self, input:contiguous(), gradOutput:contiguous())
+        return self.gradInput
+    end
+
     -- linear
     self._linearGradOutput
         :resizeAs(self.linear.output)
@@ -134,6 +158,17 @@ function UTC:updateGradInput(input, gradOutput)
 end
 
 function UTC:accGradParameters(input, gradOutput, scale)
+    local nin, nout = self.inputFrameSize, self.outputFrameSize
+    if input:dim() == 2 then
+        input = input:contiguous():view(1, input:size(1), nin)
+        gradOutput = gradOutput:contiguous()
+            :view(1, gradOutput:size(1), nout)
+    end
+    if input.nn.UnfoldedTemporalConvolution_accGradParameters then
+        input.nn.UnfoldedTemporalConvolution_accGradParameters(
+            self, input:contiguous(), gradOutput:contiguous(), scale or 1)
+        return
+    end
     self.linear:accGradParameters(
         self._unfoldedInput, self._linearGradOutput, scale
     )
@@ -145,8 +180,8 @@ function UTC:sharedAccUpdateGradParameters(input, gradOutput, lr)
 end
 
 function UTC:clearState()
-    nn.utils.clear(self, '_paddedInput', '_paddedGradInput', '_unfoldedInput',
-        '_linearGradOutput', '_unfoldedGradInput')
+    nn.utils.clear(self, 'unfolded_tile', '_paddedInput', '_paddedGradInput',
+        '_unfoldedInput', '_linearGradOutput', '_unfoldedGradInput')
     return parent.clearState(self)
 end
 
@@ -26,6 +26,8 @@ include('ClassHierarchicalNLLCriterion.lua')
 include('CrossMapNormalization.lua')
 include('GroupKMaxPooling.lua')
 include('HSM.lua')
+include('TreeHSM.lua')
+include('SampledSoftMax.lua')
 include('KMaxPooling.lua')
 include('LinearNB.lua')
 include('LaplacianOfGaussian.lua')
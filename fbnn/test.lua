@@ -162,6 +162,67 @@ function fbnntest.testSoftPlusLSECriterion()
    criterionJacobianTest(cri, input)
 end
 
+function fbnntest.LogSumExpRows()
+    for _, type in ipairs{'torch.DoubleTensor', 'torch.FloatTensor'} do
+        local input = torch.randn(6, 50):type(type)
+        input[2]:mul(1000) -- would overflow without the max shift
+        input[3]:add(800)
+        input[4]:narrow(1, 1, 20):fill(-math.huge)
+        input[5][7] = -math.huge
+        local lse = input.new()
+        input.nn.LogSumExp_rows(lse, input)
+        local max_val = torch.max(input, 2)
+        local ref = (input - max_val:expand(input:size())):exp():sum(2):log()
+        ref:add(max_val)
+        assertTensorEq(lse, ref, 1e-3)
+        local softmax = input.new()
+        input.nn.LogSumExp_expShiftedRows(softmax, input, lse)
+        assertTensorEq(softmax, torch.exp(input - ref:expand(input:size())),
+                       1e-5)
+        -- a row of -inf has a log-sum-exp of -inf, not NaN
+        input[1]:fill(-math.huge)
+        input.nn.LogSumExp_rows(lse, input)
+        mytester:asserteq(lse[1][1], -math.huge, 'LogSumExp of a -inf row')
+    end
+end
+
+function fbnntest.SoftPlusLSECriterionTypes()
+    -- criteria left in the default type take float inputs, and LSE is
+    -- n x 1 as on the Lua path
+    local input = torch.randn(4, 20):float()
+    for _, cri in ipairs{nn.SoftPlusLSECriterion(),
+                         nn.SoftPlusLSEMinusLSECriterion()} do
+        cri:forward(input)
+        local gradInput = cri:backward(input)
+        mytester:asserteq(cri.LSE:type(), 'torch.FloatTensor',
+                          'SoftPlusLSE buffer type')
+        mytester:asserteq(cri.LSE:dim(), 2, 'SoftPlusLSE LSE shape')
+        mytester:asserteq(cri.LSE:size(2), 1, 'SoftPlusLSE LSE shape')
+        mytester:asserteq(gradInput:type(), 'torch.FloatTensor',
+                          'SoftPlusLSE gradInput type')
+    end
+end
+
+function fbnntest.SoftMaxRows()
+    for _, type in ipairs{'torch.DoubleTensor', 'torch.FloatTensor'} do
+        local input = torch.randn(5, 30):type(type)
+        input[2]:mul(100)
+        local gradOutput = torch.randn(5, 30):type(type)
+        for _, case in ipairs{{nn.SoftMax(), 'softMax'},
+                              {nn.LogSoftMax(), 'logSoftMax'}} do
+            local module, name = case[1]:type(type), case[2]
+            local ref_output = module:forward(input)
+            local ref_gradInput = module:backward(input, gradOutput)
+            local output, gradInput = input.new(), input.new()
+            input.nn['LogSumExp_' .. name .. 'Rows'](output, input)
+            input.nn['LogSumExp_' .. name .. 'BackwardRows'](
+                gradInput, output, gradOutput)
+            assertTensorEq(output, ref_output, 1e-4)
+            assertTensorEq(gradInput, ref_gradInput, 1e-4)
+        end
+    end
+end
+
 function fbnntest.testLoGNetwork()
 
     -- load image:
@@ -387,6 +448,801 @@ function fbnntest.FasterLookup()
    runtest(torch.DoubleTensor():type())
 end
 
+function fbnntest.HSMGrouped()
+    local n_clusters, n_per_cluster = 5, 7
+    local input_size = 10
+    local mapping = {}
+    for c = 1, n_clusters do
+        for i = 1, n_per_cluster do
+            table.insert(mapping, {c, i})
+        end
+    end
+    local function run(hsm, input, target)
+        hsm:zeroGradParameters()
+        hsm:updateOutput(input, target)
+        hsm:updateGradInput(input, target)
+        hsm:accGradParameters(input, target, 1)
+    end
+    -- a random batch, and one with all its samples in the first cluster, so
+    -- that it is split into several chunks
+    local batches = {torch.LongTensor(32):random(1, #mapping),
+                     torch.LongTensor(200):random(1, n_per_cluster)}
+    for _, target in ipairs(batches) do
+        local input = torch.randn(target:size(1), input_size)
+        local grouped = nn.HSM(mapping, input_size)
+        local serial = grouped:clone()
+        serial.grouped = false
+        run(grouped, input, target)
+        run(serial, input, target)
+        mytester:assertlt(math.abs(grouped.output - serial.output), 1e-8,
+                          'HSM grouped output')
+        assertTensorEq(grouped.gradInput, serial.gradInput, 1e-8)
+        assertTensorEq(grouped.class_grad_weight, serial.class_grad_weight,
+                       1e-8)
+        assertTensorEq(grouped.class_grad_bias, serial.class_grad_bias, 1e-8)
+
+        -- the grouped results do not depend on the number of threads
+        local n_threads = torch.getnumthreads()
+        local other = grouped:clone()
+        torch.setnumthreads(n_threads == 1 and 4 or 1)
+        run(other, input, target)
+        torch.setnumthreads(n_threads)
+        mytester:asserteq(grouped.output, other.output,
+                          'HSM grouped output across thread counts')
+        for _, name in ipairs{'gradInput', 'class_grad_weight',
+                              'class_grad_bias'} do
+            mytester:asserteq((grouped[name] - other[name]):abs():max(), 0,
+                              'HSM grouped ' .. name ..
+                                  ' across thread counts')
+        end
+    end
+end
+
+-- HSM loss and gradients computed sample by sample with nn.Linear,
+-- nn.LogSoftMax and nn.ClassNLLCriterion, for both stages.
+local function hsmReference(hsm, input, target)
+    local batch = input
+    if input:dim() == 1 then
+        batch = input:view(1, input:size(1))
+    end
+    local input_size = batch:size(2)
+    local cluster_linear = nn.Linear(input_size, hsm.n_clusters)
+    cluster_linear.weight:copy(hsm.cluster_weight)
+    cluster_linear.bias:copy(hsm.cluster_bias)
+    cluster_linear:zeroGradParameters()
+    local cluster_net = nn.Sequential()
+        :add(cluster_linear):add(nn.LogSoftMax())
+    local crit = nn.ClassNLLCriterion()
+    crit.sizeAverage = false
+    local loss = 0
+    local gradInput = batch.new():resizeAs(batch):zero()
+    for i = 1, batch:size(1) do
+        local x = batch[i]
+        local cluster = hsm.mapping[target[i]][1]
+        local class = hsm.mapping[target[i]][2]
+        local out = cluster_net:forward(x)
+        loss = loss + crit:forward(out, cluster)
+        gradInput[i]:add(cluster_net:backward(x, crit:backward(out, cluster)))
+
+        local size = hsm.n_class_in_cluster[cluster]
+        local start = hsm.class_start_indices[cluster] + 1
+        local class_linear = nn.Linear(input_size, size)
+        class_linear.weight:copy(hsm.class_weight:narrow(1, start, size))
+        class_linear.bias:copy(hsm.class_bias:narrow(1, start, size))
+        local class_net = nn.Sequential()
+            :add(class_linear):add(nn.LogSoftMax())
+        out = class_net:forward(x)
+        loss = loss + crit:forward(out, class)
+        gradInput[i]:add(class_net:backward(x, crit:backward(out, class)))
+    end
+    return loss, gradInput:viewAs(input),
+        cluster_linear.gradWeight, cluster_linear.gradBias
+end
+
+function fbnntest.HSMReference()
+    local input_size, batch_size = 10, 9
+    for _, n_clusters in ipairs{4, 1} do
+        local mapping = {}
+        for c = 1, n_clusters do
+            for i = 1, c + 2 do
+                table.insert(mapping, {c, i})
+            end
+        end
+        local hsm = nn.HSM(mapping, input_size)
+        for _, dim in ipairs{2, 1} do
+            local input = torch.randn(batch_size, input_size)
+            local target = torch.LongTensor(batch_size):random(1, #mapping)
+            if dim == 1 then
+                input = input[1]
+                target = target:narrow(1, 1, 1)
+            end
+            hsm:zeroGradParameters()
+            local output = hsm:updateOutput(input, target)
+            local gradInput = hsm:updateGradInput(input, target)
+            hsm:accGradParameters(input, target, 1)
+            local ref_output, ref_gradInput, ref_grad_weight, ref_grad_bias =
+                hsmReference(hsm, input, target)
+            mytester:assertlt(math.abs(output - ref_output), 1e-8,
+                              'HSM output vs nn reference')
+            assertTensorEq(gradInput, ref_gradInput, 1e-8)
+            assertTensorEq(hsm.cluster_grad_weight, ref_grad_weight, 1e-8)
+            assertTensorEq(hsm.cluster_grad_bias, ref_grad_bias, 1e-8)
+        end
+    end
+end
+
+function fbnntest.HSMSparseClassGrad()
+    local n_clusters, n_per_cluster = 20, 5
+    local input_size, batch_size = 10, 8
+    local mapping = {}
+    for c = 1, n_clusters do
+        for i = 1, n_per_cluster do
+            table.insert(mapping, {c, i})
+        end
+    end
+
+    local dense = nn.HSM(mapping, input_size)
+    local sparse = dense:clone():sparseClassGrad()
+    for _, hsm in ipairs{dense, sparse} do
+        hsm:zeroGradParameters()
+    end
+    for step = 1, 3 do
+        local input = torch.randn(batch_size, input_size)
+        local target = torch.LongTensor(batch_size):random(1, #mapping)
+        for _, hsm in ipairs{dense, sparse} do
+            hsm:updateOutput(input, target)
+            hsm:updateGradInput(input, target)
+            hsm:accGradParameters(input, target, 1)
+        end
+    end
+    for _, hsm in ipairs{dense, sparse} do
+        hsm:updateParameters(0.1)
+        hsm:zeroGradParameters()
+    end
+    assertTensorEq(dense.class_weight, sparse.class_weight, 1e-8)
+    assertTensorEq(dense.class_bias, sparse.class_bias, 1e-8)
+    mytester:asserteq(sparse.n_touched[2], 0, 'HSM touched rows reset')
+    mytester:asserteq(sparse.class_grad_weight:abs():max(), 0,
+                      'HSM sparse gradients zeroed')
+end
+
+function fbnntest.HSMTopK()
+    local mapping = {}
+    for c = 1, 6 do
+        for i = 1, c do
+            table.insert(mapping, {c, i})
+        end
+    end
+    local input_size, batch_size, k = 10, 4, 5
+    local hsm = nn.HSM(mapping, input_size)
+    local input = torch.randn(batch_size, input_size)
+    local index, logprob = hsm:topk(input, k)
+    -- brute force: score every class of every sample
+    local all = torch.Tensor(batch_size, #mapping)
+    for j = 1, #mapping do
+        local target = torch.LongTensor(batch_size):fill(j)
+        for i = 1, batch_size do
+            all[i][j] = -hsm:updateOutput(input[i], target:narrow(1, i, 1))
+        end
+    end
+    local expected_logprob, expected_index = all:sort(2, true)
+    assertTensorEq(logprob, expected_logprob:narrow(2, 1, k), 1e-6)
+    mytester:asserteq((index - expected_index:narrow(2, 1, k)):abs():max(), 0,
+                      'HSM top-k classes')
+end
+
+function fbnntest.HSMCompressClassWeight()
+    local mapping = {}
+    for c = 1, 8 do
+        for i = 1, 4 do
+            table.insert(mapping, {c, i})
+        end
+    end
+    local input_size, batch_size = 10, 16
+    local input = torch.randn(batch_size, input_size)
+    local target = torch.LongTensor(batch_size):random(1, #mapping)
+    local hsm = nn.HSM(mapping, input_size)
+    local compressed = hsm:clone():compressClassWeight()
+    mytester:asserteq(compressed.class_weight:nElement(), 0,
+                      'HSM float class weights released')
+    -- the outputs only differ by the rounding of the weights
+    local output = hsm:updateOutput(input, target)
+    local gradInput = hsm:updateGradInput(input, target)
+    local c_output = compressed:updateOutput(input, target)
+    local c_gradInput = compressed:updateGradInput(input, target)
+    mytester:assertlt(math.abs(output - c_output), 1e-2 * math.abs(output),
+                      'HSM compressed output')
+    assertTensorEq(gradInput, c_gradInput, 1e-2)
+    -- direct updates are rounded into the compressed weights
+    hsm:accGradParameters(input, target, -0.1, true)
+    compressed:accGradParameters(input, target, -0.1, true)
+    compressed:decompressClassWeight()
+    assertTensorEq(hsm.class_weight, compressed.class_weight, 1e-2)
+    assertTensorEq(hsm.class_bias, compressed.class_bias, 1e-2)
+end
+
+function fbnntest.HSMSkipUnk()
+    local mapping = {}
+    for c = 1, 5 do
+        for i = 1, 3 do
+            table.insert(mapping, {c, i})
+        end
+    end
+    local input_size, batch_size, unk = 10, 12, 2
+    local input = torch.randn(batch_size, input_size)
+    local target = torch.LongTensor(batch_size):random(1, #mapping)
+    target[1], target[5] = unk, unk
+    local mask = torch.ByteTensor(batch_size):zero()
+    mask[7], target[7] = 1, 0
+    local valid = {}
+    for i = 1, batch_size do
+        if target[i] ~= unk and mask[i] == 0 then
+            table.insert(valid, i)
+        end
+    end
+    local valid_index = torch.LongTensor(valid)
+
+    local hsm = nn.HSM(mapping, input_size, unk)
+    local ref = hsm:clone()
+    ref.unk_index = 0
+    hsm.ignore_mask = mask
+    hsm:zeroGradParameters()
+    ref:zeroGradParameters()
+    local output, n_valid = hsm:updateOutput(input, target)
+    local ref_input = input:index(1, valid_index)
+    local ref_target = target:index(1, valid_index)
+    local ref_output = ref:updateOutput(ref_input, ref_target)
+    mytester:asserteq(n_valid, #valid, 'HSM number of valid samples')
+    mytester:assertlt(math.abs(output - ref_output), 1e-8, 'HSM skipped loss')
+    local gradInput = hsm:backward(input, target)
+    local ref_gradInput = ref:backward(ref_input, ref_target)
+    assertTensorEq(gradInput:index(1, valid_index), ref_gradInput, 1e-8)
+    mytester:asserteq(gradInput[1]:abs():max(), 0, 'HSM no gradient for UNK')
+    mytester:asserteq(gradInput[7]:abs():max(), 0,
+                      'HSM no gradient for ignored samples')
+    assertTensorEq(hsm.cluster_grad_weight, ref.cluster_grad_weight, 1e-8)
+    assertTensorEq(hsm.class_grad_weight, ref.class_grad_weight, 1e-8)
+end
+
+function fbnntest.HSMHogwild()
+    local n_clusters, n_per_cluster = 6, 4
+    local input_size, batch_size = 10, 40
+    local mapping = {}
+    for c = 1, n_clusters do
+        for i = 1, n_per_cluster do
+            table.insert(mapping, {c, i})
+        end
+    end
+    local input = torch.randn(batch_size, input_size)
+    local target = torch.LongTensor(batch_size):random(1, #mapping)
+
+    local direct = nn.HSM(mapping, input_size)
+    local hogwild = direct:clone()
+    direct.grouped = false
+    hogwild.hogwild = true
+    -- with every cluster hot, each is updated by a single thread in batch
+    -- order, which makes the Hogwild update deterministic
+    hogwild.hogwild_hot_clusters = n_clusters
+    for _, hsm in ipairs{direct, hogwild} do
+        hsm:updateOutput(input, target)
+        hsm:updateGradInput(input, target)
+        hsm:accGradParameters(input, target, -0.1, true)
+    end
+    assertTensorEq(direct.class_weight, hogwild.class_weight, 1e-8)
+    assertTensorEq(direct.class_bias, hogwild.class_bias, 1e-8)
+
+    local bad = hogwild:clone()
+    bad.hogwild_hot_clusters = -1
+    bad:updateOutput(input, target)
+    bad:updateGradInput(input, target)
+    mytester:assertError(function()
+        bad:accGradParameters(input, target, -0.1, true)
+    end, 'HSM negative hogwild_hot_clusters')
+end
+
+function fbnntest.SampledSoftMax()
+    local n_classes, input_size, batch_size, n_samples = 50, 8, 6, 10
+    local input = torch.randn(batch_size, input_size)
+    local target = torch.LongTensor(batch_size):random(1, n_classes)
+    for _, nce in ipairs{false, true} do
+        local crit = nn.SampledSoftMax(n_classes, input_size, n_samples)
+        crit.nce = nce
+        crit:drawSamples()
+        crit.resample = false
+        crit.sample_ids[1] = target[1] -- an accidental hit
+        -- reference: corrected logits of the target and of the samples
+        local scores = torch.mm(input, crit.weight:t())
+        scores:add(crit.bias:view(1, n_classes):expandAs(scores))
+        scores:add(-math.log(n_samples))
+        scores:add(-1, crit.log_prob:view(1, n_classes):expandAs(scores))
+        local expected = 0
+        for i = 1, batch_size do
+            local z = {scores[i][target[i]]}
+            for j = 1, n_samples do
+                if crit.sample_ids[j] ~= target[i] then
+                    table.insert(z, scores[i][crit.sample_ids[j]])
+                end
+            end
+            if nce then
+                expected = expected + math.log(1 + math.exp(-z[1]))
+                for j = 2, #z do
+                    expected = expected + math.log(1 + math.exp(z[j]))
+                end
+            else
+                local sum = 0
+                for j = 1, #z do
+                    sum = sum + math.exp(z[j])
+                end
+                expected = expected + math.log(sum) - z[1]
+            end
+        end
+        crit:zeroGradParameters()
+        local output = crit:updateOutput(input, target)
+        mytester:assertlt(math.abs(output - expected), 1e-6,
+                          'SampledSoftMax loss')
+        crit:backward(input, target)
+        -- only the rows of the targets and samples have a gradient
+        local used = torch.ByteTensor(n_classes):zero()
+        used:indexFill(1, target, 1)
+        used:indexFill(1, crit.sample_ids, 1)
+        for c = 1, n_classes do
+            if used[c] == 0 then
+                mytester:asserteq(crit.grad_weight[c]:abs():max(), 0,
+                                  'SampledSoftMax untouched row')
+            end
+        end
+        mytester:asserteq(crit.n_touched[1], used:sum(),
+                          'SampledSoftMax touched rows')
+        crit:zeroGradParameters()
+        mytester:asserteq(crit.grad_weight:abs():max(), 0,
+                          'SampledSoftMax gradients zeroed')
+    end
+end
+
+function fbnntest.KMaxPooling()
+    local length, n_cols, k = 30, 300, 4
+    local input = torch.randn(length, n_cols)
+    local module = nn.KMaxPooling(k)
+    local output = module:forward(input)
+    -- reference: the k largest values of each column, in input order
+    local _, order = input:sort(1, true)
+    local rows = order:narrow(1, 1, k):sort(1)
+    local expected = input:gather(1, rows)
+    assertTensorEq(output, expected, 1e-12)
+    mytester:asserteq((module.switches - (rows - 1)):abs():max(), 0,
+                      'KMaxPooling switches')
+end
+
+function fbnntest.KMaxPoolingBatch()
+    local batch_size, length, n_cols, k = 4, 12, 20, 3
+    local input = torch.randn(batch_size, length, n_cols)
+    local lengths = torch.LongTensor{12, 7, 2, 0}
+    local module = nn.KMaxPooling(k)
+    local out = module:forward(input, {length = lengths})
+    local gradOutput = torch.randn(batch_size, k, n_cols)
+    local gradInput = module:backward(input, gradOutput):clone()
+    for b = 1, batch_size do
+        local single = nn.KMaxPooling(k)
+        local single_out = single:forward(input[b],
+                                          {length = lengths:narrow(1, b, 1)})
+        assertTensorEq(out.output[b], single_out.output, 1e-12)
+        mytester:asserteq(out.info.length[b], single_out.info.length[1],
+                          'KMaxPooling batched output length')
+        assertTensorEq(gradInput[b], single:backward(input[b], gradOutput[b]),
+                       1e-12)
+    end
+end
+
+function fbnntest.GroupKMaxPoolingNorms()
+    local batch_size, length, n_cols, k = 3, 11, 7, 4
+    local input = torch.randn(batch_size, length, n_cols)
+    for _, p in ipairs{1, 2, math.huge} do
+        local module = nn.GroupKMaxPooling(k, -1, p)
+        local output = module:forward(input)
+        local norms
+        if p == math.huge then
+            norms = input:clone():abs():max(3)
+        else
+            norms = torch.norm(input, p, 3)
+        end
+        -- the kept rows are the k rows with the largest norms, in order
+        local _, rows = norms:squeeze(3):topk(k, 2, true)
+        rows = rows:sort(2)
+        for b = 1, batch_size do
+            for i = 1, k do
+                assertTensorEq(output[b][i], input[b][rows[b][i]], 1e-12)
+            end
+        end
+        -- explicit norms give the same rows, and must match the input
+        norms = norms:squeeze(3):contiguous()
+        output = output:clone()
+        local explicit = input.nn.GroupKMaxPooling_updateOutput(
+            module, input, norms)
+        assertTensorEq(explicit, output, 1e-12)
+        mytester:assertError(function()
+            input.nn.GroupKMaxPooling_updateOutput(
+                module, input, norms:narrow(2, 1, length - 1))
+        end, 'GroupKMaxPooling short norms')
+        mytester:assertError(function()
+            input.nn.GroupKMaxPooling_updateOutput(module, input, norms:t())
+        end, 'GroupKMaxPooling norms shape')
+    end
+end
+
+function fbnntest.KMaxPoolingSparseBackward()
+    local batch_size, length, n_cols, k = 3, 10, 17, 3
+    for _, name in ipairs{'KMaxPooling', 'GroupKMaxPooling'} do
+        local dense = nn[name](k)
+        local sparse = nn[name](k)
+        sparse.sparse_backward = true
+        for i = 1, 6 do
+            -- the length changes once to check the fallback to a full clear
+            local input = torch.randn(batch_size, i == 4 and 9 or length,
+                                      n_cols)
+            local gradOutput = torch.randn(batch_size, k, n_cols)
+            dense:forward(input)
+            sparse:forward(input)
+            assertTensorEq(sparse:backward(input, gradOutput),
+                           dense:backward(input, gradOutput), 1e-12)
+        end
+    end
+end
+
+function fbnntest.TemporalConvolutionTBCIncremental()
+    local len, batch_size, n_in, n_out, kw = 11, 3, 6, 4, 3
+    local input = torch.randn(len, batch_size, n_in)
+    local conv = nn.TemporalConvolutionTBC(n_in, n_out, kw, kw - 1)
+    local full = conv:forward(input):narrow(1, 1, len):clone()
+    for _ = 1, 2 do
+        conv:resetIncrementalState()
+        local t, step = 1, 1
+        while t <= len do
+            local n = math.min(step, len - t + 1)
+            local output = conv:updateOutputIncremental(input:narrow(1, t, n))
+            assertTensorEq(output, full:narrow(1, t, n), 1e-10)
+            t = t + n
+            step = step % 3 + 1
+        end
+    end
+    -- the lengths set for training are not used, whatever the decode batch
+    conv:setInputLengths(torch.LongTensor{len, 5, 8})
+    for _, b in ipairs{batch_size, 2} do
+        conv:resetIncrementalState()
+        for t = 1, len do
+            local output = conv:updateOutputIncremental(
+                input:narrow(1, t, 1):narrow(2, 1, b))
+            assertTensorEq(output, full:narrow(1, t, 1):narrow(2, 1, b),
+                           1e-10)
+        end
+    end
+end
+
+function fbnntest.TemporalConvolutionTBCUnfold()
+    local len, batch_size, n_in, n_out, kw, pad = 9, 4, 5, 7, 3, 1
+    local input = torch.randn(len, batch_size, n_in)
+    local gradOutput = torch.randn(len, batch_size, n_out)
+    local shifted = nn.TemporalConvolutionTBC(n_in, n_out, kw, pad)
+    shifted.unfold = false
+    local unfolded = shifted:clone()
+    unfolded.unfold = true
+    for _, conv in ipairs{shifted, unfolded} do
+        conv:zeroGradParameters()
+        conv:forward(input)
+        conv:backward(input, gradOutput)
+    end
+    assertTensorEq(unfolded.output, shifted.output, 1e-10)
+    assertTensorEq(unfolded.gradInput, shifted.gradInput, 1e-10)
+    assertTensorEq(unfolded.gradWeight, shifted.gradWeight, 1e-10)
+    assertTensorEq(unfolded.gradBias, shifted.gradBias, 1e-10)
+end
+
+function fbnntest.TemporalConvolutionTBCEpilogue()
+    local len, batch_size, n, kw, pad = 7, 3, 5, 3, 1
+    local input = torch.randn(len, batch_size, n)
+    local gradOutput = torch.randn(len, batch_size, n)
+    local fused = nn.TemporalConvolutionTBC(n, n, kw, pad, 'relu', true)
+    local conv = nn.TemporalConvolutionTBC(n, n, kw, pad)
+    conv.weight:copy(fused.weight)
+    conv.bias:copy(fused.bias)
+    local ref = nn.Sequential()
+        :add(nn.ConcatTable()
+                 :add(nn.Sequential():add(conv):add(nn.ReLU()))
+                 :add(nn.Identity()))
+        :add(nn.CAddTable())
+    for _, m in ipairs{fused, ref} do
+        m:zeroGradParameters()
+        m:forward(input)
+        m:backward(input, gradOutput)
+    end
+    assertTensorEq(fused.output, ref.output, 1e-10)
+    assertTensorEq(fused.gradInput, ref.gradInput, 1e-10)
+    assertTensorEq(fused.gradWeight, conv.gradWeight, 1e-10)
+    assertTensorEq(fused.gradBias, conv.gradBias, 1e-10)
+
+    -- GLU: first half of the planes gated by the sigmoid of the second half
+    local glu = nn.TemporalConvolutionTBC(n, n, kw, pad, 'glu')
+    local plain = nn.TemporalConvolutionTBC(n, 2 * n, kw, pad)
+    plain.weight:copy(glu.weight)
+    plain.bias:copy(glu.bias)
+    local glu_ref = nn.Sequential()
+        :add(plain)
+        :add(nn.ConcatTable()
+                 :add(nn.Narrow(3, 1, n))
+                 :add(nn.Sequential():add(nn.Narrow(3, n + 1, n))
+                          :add(nn.Sigmoid())))
+        :add(nn.CMulTable())
+    for _, m in ipairs{glu, glu_ref} do
+        m:zeroGradParameters()
+        m:forward(input)
+        m:backward(input, gradOutput)
+    end
+    assertTensorEq(glu.output, glu_ref.output, 1e-10)
+    assertTensorEq(glu.gradInput, glu_ref.gradInput, 1e-10)
+    assertTensorEq(glu.gradWeight, plain.gradWeight, 1e-10)
+    assertTensorEq(glu.gradBias, plain.gradBias, 1e-10)
+    -- without the gradient of the last updateGradInput
+    local unready = glu:clone()
+    unready:zeroGradParameters()
+    unready:forward(input)
+    unready:accGradParameters(input, gradOutput)
+    assertTensorEq(unready.gradWeight, plain.gradWeight, 1e-10)
+    assertTensorEq(unready.gradBias, plain.gradBias, 1e-10)
+end
+
+function fbnntest.TemporalConvolutionTBCStrideDilation()
+    local len, batch_size, n_in, n_out, kw = 12, 3, 4, 5, 3
+    local input = torch.randn(len, batch_size, n_in)
+
+    -- stride: as nn.TemporalConvolution with dW = 2
+    local ref = nn.TemporalConvolution(n_in, n_out, kw, 2)
+    local strided = nn.TemporalConvolutionTBC(n_in, n_out, kw, 0, nil, false,
+                                              2)
+    strided.weight:copy(ref.weight:view(n_out, kw, n_in):permute(2, 3, 1))
+    strided.bias:copy(ref.bias)
+    local expected = ref:forward(input:transpose(1, 2):contiguous())
+    assertTensorEq(strided:forward(input), expected:transpose(1, 2), 1e-10)
+
+    -- dilation: as a wider kernel with zeros between the taps
+    local dilation, pad = 2, 2
+    local dilated = nn.TemporalConvolutionTBC(n_in, n_out, kw, pad, nil,
+                                              false, 1, dilation)
+    local wide = nn.TemporalConvolutionTBC(n_in, n_out,
+                                           (kw - 1) * dilation + 1, pad)
+    wide.weight:zero()
+    for k = 1, kw do
+        wide.weight[(k - 1) * dilation + 1]:copy(dilated.weight[k])
+    end
+    wide.bias:copy(dilated.bias)
+    local gradOutput = torch.randn(len, batch_size, n_out)
+    for _, m in ipairs{dilated, wide} do
+        m:zeroGradParameters()
+        m:forward(input)
+        m:backward(input, gradOutput)
+    end
+    assertTensorEq(dilated.output, wide.output, 1e-10)
+    assertTensorEq(dilated.gradInput, wide.gradInput, 1e-10)
+    for k = 1, kw do
+        assertTensorEq(dilated.gradWeight[k],
+                       wide.gradWeight[(k - 1) * dilation + 1], 1e-10)
+    end
+end
+
+function fbnntest.TemporalConvolutionTBCPackedWeight()
+    local input = torch.randn(9, 2, 6)
+    local conv = nn.TemporalConvolutionTBC(6, 4, 3, 1)
+    local expected = conv:forward(input):clone()
+    conv:evaluate()
+    for _ = 1, 2 do
+        assertTensorEq(conv:forward(input), expected, 1e-10)
+    end
+    conv.weight:mul(2)
+    conv.bias:mul(2)
+    conv:clearPackedWeight()
+    assertTensorEq(conv:forward(input), expected * 2, 1e-10)
+    -- overwriting the weight in place repacks it
+    local params = conv:getParameters()
+    assertTensorEq(conv:forward(input), expected * 2, 1e-10)
+    params:mul(1.5)
+    assertTensorEq(conv:forward(input), expected * 3, 1e-10)
+    -- so does changing a single entry
+    conv.weight[2][3][2] = conv.weight[2][3][2] + 1
+    local updated = conv:forward(input):clone()
+    conv:training()
+    assertTensorEq(updated, conv:forward(input), 1e-10)
+end
+
+function fbnntest.TemporalConvolutionTBCLengths()
+    local len, batch_size, n_in, n_out, kw, pad = 8, 3, 4, 5, 3, 1
+    local lengths = torch.LongTensor{8, 3, 5}
+    local input = torch.randn(len, batch_size, n_in)
+    local gradOutput = torch.randn(len, batch_size, n_out)
+    local conv = nn.TemporalConvolutionTBC(n_in, n_out, kw, pad)
+    conv:setInputLengths(lengths)
+    conv:zeroGradParameters()
+    conv:forward(input)
+    conv:backward(input, gradOutput)
+    local output_lengths = conv:outputLengths(lengths)
+
+    -- each sequence convolved alone
+    local single = conv:clone():setInputLengths(nil)
+    local gradWeight = torch.zeros(conv.gradWeight:size())
+    for b = 1, batch_size do
+        local n = lengths[b]
+        local seq = input:narrow(1, 1, n):narrow(2, b, 1):clone()
+        local gradSeq = gradOutput:narrow(1, 1, output_lengths[b])
+            :narrow(2, b, 1):clone()
+        single:zeroGradParameters()
+        single:forward(seq)
+        single:backward(seq, gradSeq)
+        gradWeight:add(single.gradWeight)
+        local out = conv.output:select(2, b)
+        assertTensorEq(out:narrow(1, 1, output_lengths[b]),
+                       single.output:select(2, 1), 1e-10)
+        if output_lengths[b] < len then
+            assertTensorEq(out:narrow(1, output_lengths[b] + 1,
+                                      len - output_lengths[b]),
+                           torch.zeros(len - output_lengths[b], n_out),
+                           1e-12)
+        end
+        local gradIn = conv.gradInput:select(2, b)
+        assertTensorEq(gradIn:narrow(1, 1, n), single.gradInput:select(2, 1),
+                       1e-10)
+        if n < len then
+            assertTensorEq(gradIn:narrow(1, n + 1, len - n),
+                           torch.zeros(len - n, n_in), 1e-12)
+        end
+    end
+    assertTensorEq(conv.gradWeight, gradWeight, 1e-10)
+end
+
+function fbnntest.TemporalConvolutionTBCQuantized()
+    local input = torch.randn(9, 2, 16)
+    local conv = nn.TemporalConvolutionTBC(16, 8, 3, 1, 'relu')
+    conv:evaluate()
+    local expected = conv:forward(input):clone()
+    conv:quantize()
+    local output = conv:forward(input)
+    local tolerance = 0.05 * expected:max()
+    assertTensorEq(output, expected, tolerance)
+    assert(conv:calibrate(input) < 0.05)
+    assertTensorEq(conv:forward(input), expected, tolerance)
+
+    -- the float path in training mode and after dequantize()
+    conv:training()
+    assertTensorEq(conv:forward(input), expected, 1e-10)
+    conv:evaluate()
+    conv:dequantize()
+    assertTensorEq(conv:forward(input), expected, 1e-10)
+end
+
+function fbnntest.UnfoldedTemporalConvolution()
+    local batch_size, len, n_in, n_out, kw, pad = 3, 11, 4, 5, 4, 2
+    local input = torch.randn(batch_size, len, n_in)
+    local ref = nn.TemporalConvolution(n_in, n_out, kw, 1)
+    local padded = nn.Sequential()
+        :add(nn.Padding(2, -pad))
+        :add(nn.Padding(2, pad))
+        :add(ref)
+    local utc = nn.UnfoldedTemporalConvolution(n_in, n_out, kw, 1, pad)
+    utc.weight:copy(ref.weight)
+    utc.bias:copy(ref.bias)
+    -- tiles that do not divide the rows, and straddle batch elements
+    utc.tile_rows = 5
+    local gradOutput = torch.randn(batch_size, len + 2 * pad - kw + 1, n_out)
+    for _, m in ipairs{padded, utc} do
+        m:zeroGradParameters()
+        m:forward(input)
+        m:backward(input, gradOutput, 0.5)
+    end
+    assertTensorEq(utc.output, padded.output, 1e-10)
+    assertTensorEq(utc.gradInput, padded.gradInput, 1e-10)
+    assertTensorEq(utc.gradWeight, ref.gradWeight, 1e-10)
+    assertTensorEq(utc.gradBias, ref.gradBias, 1e-10)
+    assert(utc.unfolded_tile:size(1) == utc.tile_rows)
+end
+
+function fbnntest.TreeHSM()
+    local mapping = {}
+    for c = 1, 4 do
+        for i = 1, c + 1 do
+            table.insert(mapping, {c, i})
+        end
+    end
+    local input_size, batch_size = 10, 6
+    local input = torch.randn(batch_size, input_size)
+    local target = torch.LongTensor(batch_size):random(1, #mapping)
+
+    -- a two-level tree matches nn.HSM
+    local hsm = nn.HSM(mapping, input_size)
+    local tree = nn.TreeHSM(nn.TreeHSM.fromMapping(mapping), input_size)
+    tree.weight:copy(torch.cat(hsm.cluster_weight, hsm.class_weight, 1))
+    tree.bias:copy(torch.cat(hsm.cluster_bias, hsm.class_bias, 1))
+    for _, m in ipairs{hsm, tree} do
+        m:zeroGradParameters()
+        m:updateOutput(input, target)
+        m:updateGradInput(input, target)
+        m:accGradParameters(input, target, 1)
+    end
+    mytester:assertlt(math.abs(hsm.output - tree.output), 1e-8,
+                      'TreeHSM output')
+    assertTensorEq(hsm.gradInput, tree.gradInput, 1e-8)
+    assertTensorEq(hsm.class_grad_weight,
+                   tree.grad_weight:narrow(1, 5, #mapping), 1e-8)
+
+    -- in a deeper tree, the probabilities of all the classes sum to 1
+    -- (3 levels: root -> 2 nodes -> 2 nodes each -> the 4 clusters above)
+    local deep = {}
+    for _, m in ipairs(mapping) do
+        table.insert(deep, {m[1] + 2, m[2]})
+    end
+    for _, node in ipairs{{0, 1}, {0, 2}, {1, 1}, {1, 2}, {2, 1}, {2, 2}} do
+        table.insert(deep, node)
+    end
+    local m = nn.TreeHSM(deep, input_size)
+    mytester:asserteq(m.max_depth, 3, 'TreeHSM depth')
+    local sum = 0
+    for i = 1, #mapping do
+        sum = sum + math.exp(-m:updateOutput(input[1],
+                                             torch.LongTensor{i}))
+    end
+    mytester:assertlt(math.abs(sum - 1), 1e-6, 'TreeHSM normalization')
+end
+
+function fbnntest.HSMBuildMapping()
+    local n_classes, max_cluster_size = 500, 40
+    local freqs = torch.Tensor(n_classes)
+    for i = 1, n_classes do
+        freqs[i] = 1 / i
+    end
+    local mapping, cost, n_clusters =
+        nn.HSM.buildMapping(freqs, max_cluster_size)
+    local hsm = nn.HSM(mapping, 10)
+    mytester:asserteq(hsm.n_clusters, n_clusters, 'HSM mapping clusters')
+    mytester:assertle(hsm.n_max_class_in_cluster, max_cluster_size,
+                      'HSM mapping cluster size')
+    -- predicted cost: n_clusters + expected size of the target's cluster
+    local expected = n_clusters
+    local p = freqs / freqs:sum()
+    for i = 1, n_classes do
+        expected = expected + p[i] * hsm.n_class_in_cluster[mapping[i][1]]
+    end
+    mytester:assertlt(math.abs(cost - expected), 1e-6, 'HSM mapping cost')
+    mytester:assertlt(cost, 2 * math.sqrt(n_classes), 'HSM mapping quality')
+end
+
+function fbnntest.ClassHierarchicalNLLCriterionBatch()
+    local clusterCounts = torch.Tensor{3, 1, 4, 2}
+    local mapping = {}
+    for c = 1, clusterCounts:size(1) do
+        for i = 1, clusterCounts[c] do
+            table.insert(mapping, {c, i})
+        end
+    end
+    local inputSize, batchSize = 8, 12
+    local input = torch.randn(batchSize, inputSize)
+    local target = torch.LongTensor(batchSize):random(1, #mapping)
+
+    local batch = nn.ClassHierarchicalNLLCriterion(
+        torch.Tensor(mapping), clusterCounts, inputSize)
+    local single = batch:clone()
+    batch:zeroGradParameters()
+    single:zeroGradParameters()
+    local output = batch:updateOutput(input, target)
+    local gradInput = batch:updateGradInput(input, target)
+    local expected = 0
+    for i = 1, batchSize do
+        expected = expected + single:updateOutput(input[i], target[i])
+        assertTensorEq(gradInput[i],
+                       single:updateGradInput(input[i], target[i]), 1e-8)
+    end
+    mytester:assertlt(math.abs(output - expected), 1e-8,
+                      'ClassHierarchicalNLLCriterion batch output')
+    assertTensorEq(batch.clusterMatrixDx, single.clusterMatrixDx, 1e-8)
+    assertTensorEq(batch.clusterBiasDx, single.clusterBiasDx, 1e-8)
+    assertTensorEq(batch.classMatrixDx, single.classMatrixDx, 1e-8)
+    assertTensorEq(batch.classBiasDx, single.classBiasDx, 1e-8)
+end
+
 mytester:add(fbnntest)
 
 function nn.fbnntest(tests)
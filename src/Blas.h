@@ -137,6 +137,40 @@ inline double dsdot(long n, const float* x, long incx,
 }
 
 #undef DEFINE_OPS
+
+#if defined(INTEL_MKL_VERSION) && INTEL_MKL_VERSION >= 20170000
+// Packed gemm (MKL 2017 and later): a matrix packed once by gemm_pack is
+// passed to gemm_compute, with CblasPacked instead of its transpose flag.
+template <class T>
+size_t gemm_pack_get_size(CBLAS_IDENTIFIER identifier, long m, long n,
+                          long k);
+
+#define DEFINE_PACKED_OPS(T, P) \
+  template <> \
+  inline size_t gemm_pack_get_size<T>(CBLAS_IDENTIFIER identifier, long m, \
+                                      long n, long k) { \
+    return XI(P, gemm_pack_get_size)(identifier, m, n, k); \
+  } \
+  inline void gemm_pack(CBLAS_LAYOUT layout, CBLAS_IDENTIFIER identifier, \
+                        CBLAS_TRANSPOSE trans, long m, long n, long k, \
+                        T alpha, const T* src, long ld, T* dest) { \
+    XI(P, gemm_pack)(layout, identifier, trans, m, n, k, alpha, src, ld, \
+                     dest); \
+  } \
+  inline void gemm_compute(CBLAS_LAYOUT layout, MKL_INT transA, \
+                           MKL_INT transB, long m, long n, long k, \
+                           const T* a, long lda, const T* b, long ldb, \
+                           T beta, T* c, long ldc) { \
+    XI(P, gemm_compute)(layout, transA, transB, m, n, k, a, lda, b, ldb, \
+                        beta, c, ldc); \
+  }
+
+DEFINE_PACKED_OPS(float, s)
+DEFINE_PACKED_OPS(double, d)
+
+#undef DEFINE_PACKED_OPS
+#endif
+
 #undef XI_I
 #undef XI
 
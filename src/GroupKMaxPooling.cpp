@@ -6,6 +6,8 @@
 #include <lua.hpp>
 #include <luaT.h>
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 #include <queue>
 #include <utility>
@@ -86,24 +88,51 @@ using value_priority_queue = std::priority_queue<
   std::vector<index_value<T>>,
   value_order<T>>;
 
-// Forward pass for a single example
+// Selection score of a row: its L^1 norm, its squared L^2 norm (which
+// ranks the rows as the L^2 norm does) or its max norm (p = inf)
+template<typename T>
+T rowScore(const T* row, long n_cols, double p) {
+  T score = 0;
+  if (p == 1) {
+    #pragma omp simd reduction(+:score)
+    for (long col = 0; col < n_cols; ++col) {
+      score += std::abs(row[col]);
+    }
+  } else if (p == 2) {
+    #pragma omp simd reduction(+:score)
+    for (long col = 0; col < n_cols; ++col) {
+      score += row[col] * row[col];
+    }
+  } else {
+    #pragma omp simd reduction(max:score)
+    for (long col = 0; col < n_cols; ++col) {
+      score = std::max(score, std::abs(row[col]));
+    }
+  }
+  return score;
+}
+
+// Forward pass for a single example. The rows are ranked by `norms` if
+// given, else by their L^p norm, computed as they are read.
 template<typename T>
 void updateOutput_single(
   Tensor<T> const& input_tensor,
-  Tensor<T> const& norms_tensor,
+  const T* norms,
+  double p,
   Tensor<long>& switches_tensor,
   Tensor<T>& output_tensor,
   long k) {
 
   auto input_data = tensor_array_view(input_tensor);
-  auto norms_data = tensor_vector_view(norms_tensor);
   auto output_data = tensor_array_view(output_tensor);
   auto switches_data = tensor_vector_view(switches_tensor);
+  long n_cols = input_tensor.size(1);
 
   // compute the k-max norms
   value_priority_queue<T> kmax;
-  for (int row = 0; row < norms_tensor.size(0); ++row) {
-    T value = norms_data[row];
+  for (int row = 0; row < input_tensor.size(0); ++row) {
+    T value = norms ? norms[row]
+                    : rowScore(input_tensor.data() + row * n_cols, n_cols, p);
 
     if (kmax.size() < k || value > kmax.top().value()) {
       kmax.push(make_index_value(row, value));
@@ -145,11 +174,13 @@ void updateOutput_single(
 
 }
 
-// Forward pass
+// Forward pass. The rows are ranked by the optional `norms` argument, else
+// by the norm of order `p` (1, 2 or inf) of the input rows.
 template <class T>
 int updateOutput(lua_State* L) {
   auto const input_tensor = luaGetTensorChecked<T>(L, 2);
-  auto const norms_tensor = luaGetTensorChecked<T>(L, 3);
+  auto const norms_tensor = luaGetTensor<T>(L, 3);
+  double p = luaGetFieldIfNumber<double>(L, 1, "p").value_or(2);
   auto switches_tensor = luaGetFieldIfTensorChecked<long>(L, 1, "switches");
   auto k = luaGetFieldIfNumberChecked<long>(L, 1, "k");
   auto k_dynamic = luaGetFieldIfNumberChecked<double>(L, 1, "k_dynamic");
@@ -160,7 +191,27 @@ int updateOutput(lua_State* L) {
     input_tensor->ndims() == 2 || input_tensor->ndims() == 3,
     1,
     "input must have 2 or 3 dimensions.");
-
+  luaL_argcheck(L, input_tensor->isContiguous(), 1,
+    "input must be contiguous");
+  luaL_argcheck(L, p == 1 || p == 2 || std::isinf(p), 1,
+    "p must be 1, 2 or inf");
+  if (norms_tensor) {
+    // one norm per input row, read through a raw pointer below
+    auto const& norms = **norms_tensor;
+    long rows = input_tensor->size(input_tensor->ndims() - 2);
+    if (input_tensor->ndims() == 2) {
+      luaL_argcheck(L, norms.ndims() >= 1 && norms.size(0) == rows &&
+                    norms.size() == rows, 3,
+                    "norms must have one element per input row");
+    } else {
+      luaL_argcheck(L, norms.ndims() >= 2 &&
+                    norms.size(0) == input_tensor->size(0) &&
+                    norms.size(1) == rows &&
+                    norms.size() == input_tensor->size(0) * rows, 3,
+                    "norms must be batch x rows");
+    }
+    luaL_argcheck(L, norms.isContiguous(), 3, "norms must be contiguous");
+  }
 
   // Set k for dynamic k-max pooling
   if (k_dynamic > 0) {
@@ -177,7 +228,8 @@ int updateOutput(lua_State* L) {
 
     updateOutput_single(
       *input_tensor,
-      *norms_tensor,
+      norms_tensor ? (*norms_tensor)->data() : nullptr,
+      p,
       *switches_tensor,
       *output_tensor,
       k);
@@ -194,19 +246,25 @@ int updateOutput(lua_State* L) {
     for (int i = 0; i < input_tensor->size(0); ++i) {
       // Copy meta-data but not real-data
       Tensor<T> input_tensor_example = *input_tensor;
-      Tensor<T> norms_tensor_example = *norms_tensor;
       Tensor<long> switches_tensor_example = *switches_tensor;
       Tensor<T> output_tensor_example = *output_tensor;
 
       // Narrow to the current example
       input_tensor_example.select(0, i);
-      norms_tensor_example.select(0, i);
       switches_tensor_example.select(0, i);
       output_tensor_example.select(0, i);
 
+      const T* norms = nullptr;
+      if (norms_tensor) {
+        Tensor<T> norms_tensor_example = **norms_tensor;
+        norms_tensor_example.select(0, i);
+        norms = norms_tensor_example.data();
+      }
+
       updateOutput_single(
         input_tensor_example,
-        norms_tensor_example,
+        norms,
+        p,
         switches_tensor_example,
         output_tensor_example,
         k);
@@ -237,7 +295,22 @@ void updateGradInput_single(
   }
 }
 
+template <class T>
+bool sameSize(const Tensor<T>& a, const Tensor<T>& b) {
+  if (a.ndims() != b.ndims())
+    return false;
+  for (int d = 0; d < a.ndims(); ++d) {
+    if (a.size(d) != b.size(d))
+      return false;
+  }
+  return true;
+}
+
 // Backprop
+// With `sparse_backward`, gradInput is cleared by zeroing the rows written
+// by the previous call (kept in `grad_switches`) when its size did not
+// change, so that the cost is proportional to k rather than to the input
+// length. gradInput must then not be modified between calls.
 template <class T>
 int updateGradInput(lua_State* L) {
   auto const input_tensor = luaGetTensorChecked<T>(L, 2);
@@ -252,8 +325,27 @@ int updateGradInput(lua_State* L) {
     1,
     "gradOutput must have exactly 2 or 3 dimensions.");
 
-  gradInput_tensor->resizeAs(*input_tensor);
-  gradInput_tensor->fill(0.0);
+  bool sparse = luaGetFieldIfBoolean(L, 1, "sparse_backward").value_or(false);
+  auto grad_switches = luaGetFieldIfTensor<long>(L, 1, "grad_switches");
+  sparse = sparse && grad_switches;
+  if (sparse && sameSize(*gradInput_tensor, *input_tensor) &&
+      (*grad_switches)->ndims() == input_tensor->ndims() - 1) {
+    const Tensor<long>& prev_switches = **grad_switches;
+    long n_rows = input_tensor->size(input_tensor->ndims() - 2);
+    long n_cols = input_tensor->size(input_tensor->ndims() - 1);
+    long n_switches = prev_switches.size();
+    // the switches of all examples, as rows of the flattened gradInput
+    long prev_k = prev_switches.size(prev_switches.ndims() - 1);
+    #pragma omp parallel for if (n_switches * n_cols > 100000)
+    for (long i = 0; i < n_switches; ++i) {
+      long row = (i / prev_k) * n_rows + prev_switches.data()[i];
+      std::fill(gradInput_tensor->data() + row * n_cols,
+                gradInput_tensor->data() + (row + 1) * n_cols, T(0));
+    }
+  } else {
+    gradInput_tensor->resizeAs(*input_tensor);
+    gradInput_tensor->fill(0.0);
+  }
 
   if (gradOutput_tensor->ndims() == 2) {
     updateGradInput_single(
@@ -281,6 +373,10 @@ int updateGradInput(lua_State* L) {
         gradInput_tensor_example);
     }
   }
+  if (sparse) {
+    (*grad_switches)->resizeAs(*switches_tensor);
+    (*grad_switches)->copy(*switches_tensor);
+  }
 
   lua_pushvalue(L, gradInputIdx);
   return 1;
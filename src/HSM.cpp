@@ -2,9 +2,15 @@
 // Author: Michael Mathieu <myrhev@fb.com>
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <functional>
 #include <memory>
 #include <limits>
+#include <utility>
+#include <vector>
 
 #include <lua.hpp>
 #include <mkl.h>
@@ -32,11 +38,645 @@ namespace {
 
 template <class T> using thOps = thpp::detail::TensorOps<T>;
 
+// Samples of a minibatch, bucketed by the cluster of their target. Bucket i
+// holds the samples order[offsets[i]] .. order[offsets[i+1] - 1] (in batch
+// order), which all belong to the (0-based) cluster clusters[i]. The class
+// stage then runs one GEMM per touched cluster instead of one GEMV per
+// sample.
+//
+// Buckets are further cut into chunks of at most kChunkSize samples, which
+// are the units of work handed to the threads. The chunk size does not
+// depend on the number of threads, so the results do not either.
+struct ClusterBuckets {
+  static constexpr long kChunkSize = 64;
+
+  struct Chunk {
+    long bucket;
+    long begin;  // into order
+    long end;
+  };
+
+  std::vector<long> order;
+  std::vector<long> clusters;
+  std::vector<long> offsets;
+  std::vector<Chunk> chunks;
+
+  long size() const { return clusters.size(); }
+  long bucketSize(long i) const { return offsets[i + 1] - offsets[i]; }
+  const long* samples(long i) const { return order.data() + offsets[i]; }
+  long numChunks(long i) const {
+    return (bucketSize(i) + kChunkSize - 1) / kChunkSize;
+  }
+};
+
+// Samples flagged in `skip` (if not nullptr) are left out of the buckets.
+void bucketByCluster(const Tensor<long>& target, const Tensor<long>& mapping,
+                     long batch_size, ClusterBuckets& buckets,
+                     const char* skip = nullptr) {
+  std::vector<std::pair<long, long>> keys;
+  keys.reserve(batch_size);
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+    if (skip && skip[i_batch])
+      continue;
+    long itarget = target.at({i_batch}) - 1; // 1based->0based
+    keys.emplace_back(mapping.at({itarget, 0}) - 1, i_batch);
+  }
+  std::sort(keys.begin(), keys.end());
+  long n_samples = keys.size();
+  buckets.order.resize(n_samples);
+  buckets.clusters.clear();
+  buckets.offsets.clear();
+  for (long i = 0; i < n_samples; ++i) {
+    if (i == 0 || keys[i].first != keys[i - 1].first) {
+      buckets.clusters.push_back(keys[i].first);
+      buckets.offsets.push_back(i);
+    }
+    buckets.order[i] = keys[i].second;
+  }
+  buckets.offsets.push_back(n_samples);
+  buckets.chunks.clear();
+  for (long b = 0; b < buckets.size(); ++b)
+    for (long begin = buckets.offsets[b]; begin < buckets.offsets[b + 1];
+         begin += ClusterBuckets::kChunkSize)
+      buckets.chunks.push_back({b, begin, std::min(
+            begin + ClusterBuckets::kChunkSize, buckets.offsets[b + 1])});
+}
+
+// Flags in `skip` the samples left out of the loss and of the gradients:
+// those whose target is `unk_index` (unless it is 0), and those set in the
+// optional ByteTensor `ignore_mask` (of batch_size elements). Returns the
+// number of remaining samples.
+long skippedSamples(lua_State* L, const Tensor<long>& target, long batch_size,
+                    std::vector<char>& skip) {
+  auto unk_index = luaGetFieldIfNumber<long>(L, 1, "unk_index").value_or(0);
+  auto ignore_mask = luaGetFieldIfTensor<unsigned char>(L, 1, "ignore_mask");
+  if (ignore_mask)
+    luaL_argcheck(L, (*ignore_mask)->size() == batch_size, 1,
+                  "ignore_mask must have one element per sample");
+  skip.assign(batch_size, 0);
+  long n_valid = 0;
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+    skip[i_batch] = (unk_index != 0 && target.at({i_batch}) == unk_index) ||
+      (ignore_mask && (*ignore_mask)->at({i_batch}) != 0);
+    n_valid += !skip[i_batch];
+  }
+  return n_valid;
+}
+
+// Class weights stored as bfloat16 (see HSM:compressClassWeight), or
+// nullptr. Each weight is the upper half of its float32 representation, and
+// the rows live in a ByteTensor of n_classes x (2 * input_size) bytes.
+typedef Tensor<unsigned char> BF16Weight;
+
+const BF16Weight* getBF16Weight(lua_State* L) {
+  auto weight = luaGetFieldIfTensor<unsigned char>(L, 1, "class_weight_bf16");
+  return weight ? &**weight : nullptr;
+}
+
+inline float bf16ToFloat(uint16_t x) {
+  uint32_t bits = uint32_t(x) << 16;
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// Rounds to the nearest bfloat16 (ties to even).
+inline uint16_t floatToBF16(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  if ((bits & 0x7fffffff) > 0x7f800000) // NaN
+    return (bits >> 16) | 0x40;
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return bits >> 16;
+}
+
+inline const uint16_t* bf16Row(const BF16Weight& weight, long row) {
+  return reinterpret_cast<const uint16_t*>(weight.data() +
+                                           row * weight.stride(0));
+}
+
+inline uint16_t* bf16Row(BF16Weight& weight, long row) {
+  return reinterpret_cast<uint16_t*>(weight.data() + row * weight.stride(0));
+}
+
+// Rows istart .. istart + n - 1 of the class weights: directly from
+// `weight`, or converted into `buf` if they are stored as bfloat16. Sets
+// `ld` to the distance between rows.
+template <class T>
+const T* classWeightRows(const Tensor<T>& weight, const BF16Weight* weight_bf16,
+                         long istart, long n, long input_size,
+                         std::vector<T>& buf, long& ld) {
+  if (!weight_bf16) {
+    ld = weight.stride(0);
+    return weight.data() + istart * ld;
+  }
+  ld = input_size;
+  buf.resize(n * input_size);
+  for (long i = 0; i < n; ++i) {
+    const uint16_t* row = bf16Row(*weight_bf16, istart + i);
+    for (long d = 0; d < input_size; ++d)
+      buf[i * input_size + d] = bf16ToFloat(row[d]);
+  }
+  return buf.data();
+}
+
+// Adds `delta` (n x input_size) to rows istart .. istart + n - 1 of the
+// bfloat16 class weights, rounding the results.
+template <class T>
+void addToBF16Rows(BF16Weight& weight, long istart, long n, long input_size,
+                   const T* delta) {
+  for (long i = 0; i < n; ++i) {
+    uint16_t* row = bf16Row(weight, istart + i);
+    for (long d = 0; d < input_size; ++d)
+      row[d] = floatToBF16(bf16ToFloat(row[d]) + delta[i * input_size + d]);
+  }
+}
+
+// Whether to run the class stage through the cluster-grouped GEMM path. It
+// is on by default and can be turned off by setting `grouped` to false on
+// the module. The bfloat16 class weights are only read by this path.
+bool useGrouped(lua_State* L, long batch_size) {
+  if (getBF16Weight(L))
+    return true;
+  return batch_size > 1 &&
+    luaGetFieldIfBoolean(L, 1, "grouped").value_or(true);
+}
+
+// Copies the rows `rows[0] .. rows[n-1]` of the 2d tensor `src` into the
+// contiguous n x src.size(1) buffer `dst`. A 1d `src` is a single row.
+template <class T>
+void gatherRows(const Tensor<T>& src, const long* rows, long n, T* dst) {
+  long dim = src.size(src.ndims() - 1);
+  long stride = (src.ndims() == 1) ? 0 : src.stride(0);
+  for (long i = 0; i < n; ++i)
+    blas::copy(dim, src.data() + rows[i] * stride,
+               src.stride(src.ndims() - 1), dst + i * dim, 1);
+}
+
+// Adds the contiguous n x dst.size(1) buffer `src` to the rows
+// `rows[0] .. rows[n-1]` of the 2d tensor `dst`. A 1d `dst` is a single row.
+template <class T>
+void scatterAddRows(const T* src, const long* rows, long n, Tensor<T>& dst) {
+  long dim = dst.size(dst.ndims() - 1);
+  long stride = (dst.ndims() == 1) ? 0 : dst.stride(0);
+  for (long i = 0; i < n; ++i)
+    blas::axpy(dim, 1, src + i * dim, 1,
+               dst.data() + rows[i] * stride, dst.stride(dst.ndims() - 1));
+}
+
+// Log-sum-exp of the n scores x, with a per-thread scratch buffer.
+template <class T>
+T logSumExp(const T* x, long n) {
+  static thread_local std::vector<T> work;
+  work.resize(n);
+  return vml::logSumExp(n, x, work.data());
+}
+
+// Overwrites the n scores x, whose log-sum-exp is `logsum`, with the
+// gradient of the NLL of `target` wrt them: softmax(x) - onehot(target),
+// through the log-softmax backward. Uses per-thread scratch buffers.
+template <class T>
+void nllGradient(T* x, long n, T logsum, long target) {
+  static thread_local std::vector<T> grad, work;
+  grad.assign(n, T(0));
+  grad[target] = -1.;
+  work.resize(n);
+  for (long i = 0; i < n; ++i)
+    x[i] -= logsum;
+  vml::logSoftMaxBackward(n, x, grad.data(), x, work.data());
+}
+
+// Cluster stage of the forward pass: cluster_score = input * cluster_weight^T
+// + cluster_bias, its log-sum-exp in `cluster_logsum`, and the cluster part
+// of the loss, in one pass per sample.
+template <class T>
+T updateOutputCluster(const Tensor<T>& input,
+                      const Tensor<T>& cluster_weight,
+                      const Tensor<T>& cluster_bias,
+                      Tensor<T>& cluster_score,
+                      Tensor<T>& cluster_logsum,
+                      const Tensor<long>& mapping,
+                      const Tensor<long>& target,
+                      long batch_size,
+                      const char* skip = nullptr) {
+  long n_clusters = cluster_weight.size(0);
+  long input_size = cluster_weight.size(1);
+  long input_stride = (input.ndims() == 1) ? 0 : input.stride(0);
+  long input_inc = input.stride(input.ndims() - 1);
+  if (input_inc == 1 && batch_size > 1) {
+    //   scores of the whole batch at once
+    blas::gemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+               batch_size, n_clusters, input_size,
+               1, input.data(), input_stride,
+               cluster_weight.data(), cluster_weight.stride(0),
+               0, cluster_score.data(), n_clusters);
+  }
+  std::vector<T> sample_output(batch_size, 0.);
+#pragma omp parallel for if (batch_size > 1)
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+    T* score_data = cluster_score.data() + i_batch * n_clusters;
+    if (input_inc != 1 || batch_size == 1)
+      blas::gemv(CblasRowMajor, CblasNoTrans, n_clusters, input_size,
+                 1, cluster_weight.data(), cluster_weight.stride(0),
+                 input.data() + i_batch * input_stride, input_inc,
+                 0, score_data, 1);
+    for (long c = 0; c < n_clusters; ++c)
+      score_data[c] += cluster_bias.at({c});
+    if (skip && skip[i_batch])
+      continue;
+    long itarget = target.at({i_batch}) - 1; // 1based->0based
+    long cluster_target = mapping.at({itarget, 0}) - 1; // 1based->0based
+    T cluster_logsum_local = logSumExp(score_data, n_clusters);
+    cluster_logsum.at({i_batch}) = cluster_logsum_local;
+    sample_output[i_batch] = cluster_logsum_local - score_data[cluster_target];
+  }
+  T output = 0.;
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch)
+    output += sample_output[i_batch];
+  return output;
+}
+
+// Cluster stage of updateGradInput: turns `cluster_score` into the gradient
+// of the loss wrt the cluster scores (which accGradParameters then uses),
+// and sets gradInput to its product with cluster_weight.
+template <class T>
+void updateGradInputCluster(Tensor<T>& gradInput,
+                            const Tensor<T>& cluster_weight,
+                            Tensor<T>& cluster_score,
+                            const Tensor<T>& cluster_logsum,
+                            const Tensor<long>& mapping,
+                            const Tensor<long>& target,
+                            long batch_size,
+                            const char* skip = nullptr) {
+  long n_clusters = cluster_weight.size(0);
+  long input_size = cluster_weight.size(1);
+#pragma omp parallel for if (batch_size > 1)
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+    T* score_data = cluster_score.data() + i_batch * n_clusters;
+    if (skip && skip[i_batch]) {
+      //   no gradient (so no gradInput and no cluster update either)
+      std::fill(score_data, score_data + n_clusters, T(0));
+      continue;
+    }
+    long itarget = target.at({i_batch}) - 1; // 1based->0based
+    long cluster_target = mapping.at({itarget, 0}) - 1; // 1based->0based
+    T cluster_logsum_local = cluster_logsum.at({i_batch});
+    nllGradient(score_data, n_clusters, cluster_logsum_local, cluster_target);
+  }
+  blas::gemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+             batch_size, input_size, n_clusters,
+             1, cluster_score.data(), n_clusters,
+             cluster_weight.data(), cluster_weight.stride(0),
+             0, gradInput.data(), input_size);
+}
+
+// Class stage of the forward pass, one GEMM per chunk of a touched cluster.
+template <class T>
+T updateOutputGrouped(const ClusterBuckets& buckets,
+                      const Tensor<T>& input,
+                      const Tensor<T>& class_weight,
+                      const Tensor<T>& class_bias,
+                      Tensor<T>& class_score,
+                      Tensor<T>& class_logsum,
+                      const Tensor<long>& mapping,
+                      const Tensor<long>& target,
+                      const Tensor<long>& n_class_in_cluster,
+                      const Tensor<long>& class_start_indices,
+                      const BF16Weight* class_weight_bf16 = nullptr) {
+  long input_size = input.size(input.ndims() - 1);
+  long n_chunks = buckets.chunks.size();
+  // per-chunk losses, summed in a fixed order below
+  std::vector<T> chunk_output(n_chunks, 0.);
+#pragma omp parallel
+  {
+    std::vector<T> input_buf, score_buf, weight_buf;
+#pragma omp for schedule(dynamic)
+    for (long c = 0; c < n_chunks; ++c) {
+      const auto& chunk = buckets.chunks[c];
+      long cluster = buckets.clusters[chunk.bucket];
+      long n = chunk.end - chunk.begin;
+      const long* samples = buckets.order.data() + chunk.begin;
+      long cluster_size = n_class_in_cluster.at({cluster});
+      long istart = class_start_indices.at({cluster});
+      input_buf.resize(n * input_size);
+      score_buf.resize(n * cluster_size);
+      gatherRows(input, samples, n, input_buf.data());
+      long ld;
+      const T* weight_data =
+        classWeightRows(class_weight, class_weight_bf16, istart, cluster_size,
+                        input_size, weight_buf, ld);
+      //   compute scores of the whole chunk (input * weight^T)
+      blas::gemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                 n, cluster_size, input_size,
+                 1, input_buf.data(), input_size, weight_data, ld,
+                 0, score_buf.data(), cluster_size);
+      const T* bias_data = class_bias.data() + istart * class_bias.stride(0);
+      for (long j = 0; j < n; ++j) {
+        long i_batch = samples[j];
+        long itarget = target.at({i_batch}) - 1; // 1based->0based
+        long idx_in_cluster_target =
+          mapping.at({itarget, 1}) - 1; // 1based->0based
+        //   add bias and scatter to the score of the sample
+        T* score_data = class_score.data() + i_batch * class_score.stride(0);
+        const T* chunk_score = score_buf.data() + j * cluster_size;
+        for (long d = 0; d < cluster_size; ++d)
+          score_data[d] = chunk_score[d] + bias_data[d * class_bias.stride(0)];
+        //   compute logsoftmax of score
+        T class_logsum_local = logSumExp(score_data, cluster_size);
+        class_logsum.at({i_batch}) = class_logsum_local;
+        chunk_output[c] +=
+          class_logsum_local - score_data[idx_in_cluster_target];
+      }
+    }
+  }
+  T output = 0.;
+  for (long c = 0; c < n_chunks; ++c)
+    output += chunk_output[c];
+  return output;
+}
+
+// Class stage of updateGradInput, one GEMM per chunk of a touched cluster.
+// Leaves the gradient of the class scores in `class_score`.
+template <class T>
+void updateGradInputGrouped(const ClusterBuckets& buckets,
+                            Tensor<T>& gradInput,
+                            const Tensor<T>& class_weight,
+                            Tensor<T>& class_score,
+                            const Tensor<T>& class_logsum,
+                            const Tensor<long>& mapping,
+                            const Tensor<long>& target,
+                            const Tensor<long>& n_class_in_cluster,
+                            const Tensor<long>& class_start_indices,
+                            const BF16Weight* class_weight_bf16 = nullptr) {
+  long input_size = gradInput.size(gradInput.ndims() - 1);
+  long n_chunks = buckets.chunks.size();
+#pragma omp parallel
+  {
+    std::vector<T> grad_buf, score_buf, weight_buf;
+#pragma omp for schedule(dynamic)
+    for (long c = 0; c < n_chunks; ++c) {
+      const auto& chunk = buckets.chunks[c];
+      long cluster = buckets.clusters[chunk.bucket];
+      long n = chunk.end - chunk.begin;
+      const long* samples = buckets.order.data() + chunk.begin;
+      long cluster_size = n_class_in_cluster.at({cluster});
+      long istart = class_start_indices.at({cluster});
+      score_buf.resize(n * cluster_size);
+      grad_buf.resize(n * input_size);
+      //   compute gradInput of the logsoftmax (into class_score)
+      for (long j = 0; j < n; ++j) {
+        long i_batch = samples[j];
+        long itarget = target.at({i_batch}) - 1; // 1based->0based
+        long idx_in_cluster_target =
+          mapping.at({itarget, 1}) - 1; // 1based->0based
+        T class_logsum_local = class_logsum.at({i_batch});
+        T* score_data = class_score.data() + i_batch * class_score.stride(0);
+        nllGradient(score_data, cluster_size, class_logsum_local,
+                    idx_in_cluster_target);
+        std::copy(score_data, score_data + cluster_size,
+                  score_buf.data() + j * cluster_size);
+      }
+      //   compute gradInput of the linear part for the whole chunk
+      long ld;
+      const T* weight_data =
+        classWeightRows(class_weight, class_weight_bf16, istart, cluster_size,
+                        input_size, weight_buf, ld);
+      blas::gemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                 n, input_size, cluster_size,
+                 1, score_buf.data(), cluster_size, weight_data, ld,
+                 0, grad_buf.data(), input_size);
+      // each sample is in exactly one chunk, so the rows do not overlap
+      scatterAddRows(grad_buf.data(), samples, n, gradInput);
+    }
+  }
+}
+
+// Accumulates scale * class_score^T * input into the class slices of
+// `weight` and `bias`, one GEMM per chunk of a touched cluster. Used both
+// for the gradient buffers and for the direct update. The slice of cluster
+// c starts at row weight_start_indices[c].
+//
+// A cluster with a single chunk is owned by the thread processing it. The
+// chunks of a larger cluster are accumulated into thread-private buffers
+// first, and then reduced into the cluster slice in chunk order, so that
+// the result is deterministic.
+template <class T>
+void accGradParametersGrouped(const ClusterBuckets& buckets,
+                              const Tensor<T>& input,
+                              const Tensor<T>& class_score,
+                              Tensor<T>& weight,
+                              Tensor<T>& bias,
+                              const Tensor<long>& n_class_in_cluster,
+                              const Tensor<long>& weight_start_indices,
+                              T scale) {
+  long input_size = input.size(input.ndims() - 1);
+  long n_chunks = buckets.chunks.size();
+  // private accumulators of the chunks of clusters split across chunks
+  std::vector<std::vector<T>> partial_weight(n_chunks);
+  std::vector<std::vector<T>> partial_bias(n_chunks);
+#pragma omp parallel
+  {
+    std::vector<T> input_buf, score_buf;
+#pragma omp for schedule(dynamic)
+    for (long c = 0; c < n_chunks; ++c) {
+      const auto& chunk = buckets.chunks[c];
+      long cluster = buckets.clusters[chunk.bucket];
+      long n = chunk.end - chunk.begin;
+      const long* samples = buckets.order.data() + chunk.begin;
+      long cluster_size = n_class_in_cluster.at({cluster});
+      long istart = weight_start_indices.at({cluster});
+      input_buf.resize(n * input_size);
+      score_buf.resize(n * cluster_size);
+      gatherRows(input, samples, n, input_buf.data());
+      for (long j = 0; j < n; ++j)
+        blas::copy(cluster_size,
+                   class_score.data() + samples[j] * class_score.stride(0), 1,
+                   score_buf.data() + j * cluster_size, 1);
+      T* weight_data = weight.data() + istart * weight.stride(0);
+      long ldw = weight.stride(0);
+      T* bias_data = bias.data() + istart * bias.stride(0);
+      long bias_stride = bias.stride(0);
+      T beta = 1;
+      if (buckets.numChunks(chunk.bucket) > 1) {
+        partial_weight[c].resize(cluster_size * input_size);
+        partial_bias[c].assign(cluster_size, 0);
+        weight_data = partial_weight[c].data();
+        ldw = input_size;
+        bias_data = partial_bias[c].data();
+        bias_stride = 1;
+        beta = 0;
+      }
+      blas::gemm(CblasRowMajor, CblasTrans, CblasNoTrans,
+                 cluster_size, input_size, n,
+                 scale, score_buf.data(), cluster_size,
+                 input_buf.data(), input_size,
+                 beta, weight_data, ldw);
+      for (long j = 0; j < n; ++j)
+        blas::axpy(cluster_size, scale, score_buf.data() + j * cluster_size, 1,
+                   bias_data, bias_stride);
+    }
+  }
+  // reduce the private accumulators, in chunk order
+  long c = 0;
+  for (long b = 0; b < buckets.size(); ++b) {
+    long n_bucket_chunks = buckets.numChunks(b);
+    if (n_bucket_chunks > 1) {
+      long cluster = buckets.clusters[b];
+      long cluster_size = n_class_in_cluster.at({cluster});
+      long istart = weight_start_indices.at({cluster});
+#pragma omp parallel for
+      for (long d = 0; d < cluster_size; ++d) {
+        T* weight_row = weight.data() + (istart + d) * weight.stride(0);
+        for (long k = c; k < c + n_bucket_chunks; ++k) {
+          blas::axpy(input_size, 1, partial_weight[k].data() + d * input_size,
+                     1, weight_row, weight.stride(1));
+          bias.at({istart + d}) += partial_bias[k][d];
+        }
+      }
+    }
+    c += n_bucket_chunks;
+  }
+}
+
+// Direct update of bfloat16 class weights: the update of each cluster is
+// computed in full precision, then added to its rows and rounded. Each
+// cluster is owned by a single thread. The biases stay in `bias`.
+template <class T>
+void accGradParametersBF16(const ClusterBuckets& buckets,
+                           const Tensor<T>& input,
+                           const Tensor<T>& class_score,
+                           BF16Weight& weight,
+                           Tensor<T>& bias,
+                           const Tensor<long>& n_class_in_cluster,
+                           const Tensor<long>& class_start_indices,
+                           T scale) {
+  long input_size = input.size(input.ndims() - 1);
+#pragma omp parallel if (buckets.size() > 1)
+  {
+    std::vector<T> input_buf, score_buf, delta_buf;
+#pragma omp for schedule(dynamic)
+    for (long b = 0; b < buckets.size(); ++b) {
+      long cluster = buckets.clusters[b];
+      long n = buckets.bucketSize(b);
+      const long* samples = buckets.samples(b);
+      long cluster_size = n_class_in_cluster.at({cluster});
+      long istart = class_start_indices.at({cluster});
+      input_buf.resize(n * input_size);
+      score_buf.resize(n * cluster_size);
+      delta_buf.resize(cluster_size * input_size);
+      gatherRows(input, samples, n, input_buf.data());
+      for (long j = 0; j < n; ++j)
+        blas::copy(cluster_size,
+                   class_score.data() + samples[j] * class_score.stride(0), 1,
+                   score_buf.data() + j * cluster_size, 1);
+      blas::gemm(CblasRowMajor, CblasTrans, CblasNoTrans,
+                 cluster_size, input_size, n,
+                 scale, score_buf.data(), cluster_size,
+                 input_buf.data(), input_size,
+                 0, delta_buf.data(), input_size);
+      addToBF16Rows(weight, istart, cluster_size, input_size,
+                    delta_buf.data());
+      for (long j = 0; j < n; ++j)
+        blas::axpy(cluster_size, scale, score_buf.data() + j * cluster_size, 1,
+                   bias.data() + istart * bias.stride(0), bias.stride(0));
+    }
+  }
+}
+
+// Sparse mode (see HSM:sparseClassGrad): gives a row in the compact
+// gradient buffers to each cluster of `buckets` that was not touched since
+// the last zeroGradParametersTouched. `class_grad_offset` holds the first
+// row of each touched cluster (-1 for the others), `touched_clusters` lists
+// them, and `n_touched` counts the touched clusters and rows.
+void touchClusters(const ClusterBuckets& buckets,
+                   const Tensor<long>& n_class_in_cluster,
+                   Tensor<long>& class_grad_offset,
+                   Tensor<long>& touched_clusters,
+                   Tensor<long>& n_touched) {
+  for (long b = 0; b < buckets.size(); ++b) {
+    long cluster = buckets.clusters[b];
+    if (class_grad_offset.at({cluster}) >= 0)
+      continue;
+    class_grad_offset.at({cluster}) = n_touched.at({1});
+    touched_clusters.at({n_touched.at({0})}) = cluster;
+    n_touched.at({0}) += 1;
+    n_touched.at({1}) += n_class_in_cluster.at({cluster});
+  }
+}
+
+// Hogwild variant of the direct update of the class parameters: the threads
+// take disjoint slices of the batch and update the cluster slices of their
+// samples without any locking, so concurrent updates of a cluster may be
+// lost or interleaved. The `n_hot` clusters with the most samples in the
+// batch are instead each updated by a single thread, in batch order.
+template <class T>
+void accGradParametersHogwild(const ClusterBuckets& buckets,
+                              const Tensor<T>& input,
+                              const Tensor<T>& class_score,
+                              Tensor<T>& weight,
+                              Tensor<T>& bias,
+                              const Tensor<long>& mapping,
+                              const Tensor<long>& target,
+                              const Tensor<long>& n_class_in_cluster,
+                              const Tensor<long>& class_start_indices,
+                              long n_hot,
+                              long batch_size,
+                              const char* skip,
+                              T scale) {
+  long input_size = weight.size(1);
+  long input_stride = (input.ndims() == 1) ? 0 : input.stride(0);
+  long input_inc = input.stride(input.ndims() - 1);
+  //   hottest buckets first
+  std::vector<long> hot(buckets.size());
+  for (long b = 0; b < buckets.size(); ++b)
+    hot[b] = b;
+  n_hot = std::min(n_hot, buckets.size());
+  std::partial_sort(hot.begin(), hot.begin() + n_hot, hot.end(),
+                    [&](long a, long b) {
+                      return buckets.bucketSize(a) > buckets.bucketSize(b);
+                    });
+  hot.resize(n_hot);
+  std::vector<char> is_hot(n_class_in_cluster.size(0), 0);
+  for (long b : hot)
+    is_hot[buckets.clusters[b]] = 1;
+  auto update = [&](long i_batch, long cluster) {
+    long cluster_size = n_class_in_cluster.at({cluster});
+    long istart = class_start_indices.at({cluster});
+    const T* score_data = class_score.data() + i_batch * class_score.stride(0);
+    blas::ger(CblasRowMajor, cluster_size, input_size, scale, score_data, 1,
+              input.data() + i_batch * input_stride, input_inc,
+              weight.data() + istart * weight.stride(0), weight.stride(0));
+    blas::axpy(cluster_size, scale, score_data, 1,
+               bias.data() + istart * bias.stride(0), bias.stride(0));
+  };
+#pragma omp parallel
+  {
+#pragma omp for schedule(dynamic) nowait
+    for (long h = 0; h < n_hot; ++h) {
+      long b = hot[h];
+      for (long j = 0; j < buckets.bucketSize(b); ++j)
+        update(buckets.samples(b)[j], buckets.clusters[b]);
+    }
+#pragma omp for schedule(static)
+    for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+      if (skip[i_batch])
+        continue;
+      long itarget = target.at({i_batch}) - 1; // 1based->0based
+      long cluster_target = mapping.at({itarget, 0}) - 1; // 1based->0based
+      if (!is_hot[cluster_target])
+        update(i_batch, cluster_target);
+    }
+  }
+}
+
 template <class T>
 int updateOutputWithTarget(lua_State* L) {
+  auto cluster_weight = luaGetFieldIfTensorChecked<T>(L, 1, "cluster_weight");
   auto class_weight   = luaGetFieldIfTensorChecked<T>(L, 1, "class_weight");
   auto class_bias     = luaGetFieldIfTensorChecked<T>(L, 1, "class_bias");
   auto cluster_bias   = luaGetFieldIfTensorChecked<T>(L, 1, "cluster_bias");
+  auto cluster_score  = luaGetFieldIfTensorChecked<T>(L, 1, "cluster_score");
+  auto cluster_logsum = luaGetFieldIfTensorChecked<T>(L, 1, "cluster_logsum");
   auto class_score    = luaGetFieldIfTensorChecked<T>(L, 1, "class_score");
   auto class_logsum   = luaGetFieldIfTensorChecked<T>(L, 1, "class_logsum");
   auto mapping        = luaGetFieldIfTensorChecked<long>(L, 1, "mapping");
@@ -51,11 +691,30 @@ int updateOutputWithTarget(lua_State* L) {
   auto batch_size = input->size(0);
   if (input->ndims() == 1)
     batch_size = 1;
+  std::vector<char> skip;
+  long n_valid = skippedSamples(L, *target, batch_size, skip);
 
-  T output = 0.;
-  long n_valid = 0;
-  T loss;
+  // cluster
+  T output = updateOutputCluster(*input, *cluster_weight, *cluster_bias,
+                                 *cluster_score, *cluster_logsum, *mapping,
+                                 *target, batch_size, skip.data());
+  if (useGrouped(L, batch_size)) {
+    ClusterBuckets buckets;
+    bucketByCluster(*target, *mapping, batch_size, buckets, skip.data());
+    output += updateOutputGrouped(buckets, *input, *class_weight, *class_bias,
+                                 *class_score, *class_logsum, *mapping,
+                                 *target, *n_class_in_cluster,
+                                 *class_start_indices, getBF16Weight(L));
+    lua_pushnumber(L, output);
+    lua_pushnumber(L, n_valid);
+    return 2;
+  }
+  // per-sample losses, summed in a fixed order below
+  std::vector<T> sample_output(batch_size, 0.);
+#pragma omp parallel for if (batch_size > 1)
   for (int i_batch = 0; i_batch < batch_size; ++i_batch) {
+    if (skip[i_batch])
+      continue;
     long itarget = target->at({i_batch}) - 1; // 1based->0based
     long cluster_target = mapping->at({itarget, 0}) - 1; // 1based->0based
     long idx_in_cluster_target =
@@ -75,16 +734,15 @@ int updateOutputWithTarget(lua_State* L) {
     assert(class_score_used.isContiguous());
     T* score_data = class_score_used.data();
     //   compute logsoftmax of score
-    T maxInput = class_score_used.maxall();
-    double class_logsum_local = 0.;
-    for (int d = 0; d < cluster_size; ++d)
-      class_logsum_local += THExpMinusApprox(maxInput - score_data[d]);
-    class_logsum_local = maxInput + log(class_logsum_local);
-    loss = class_logsum_local - class_score_used.at({idx_in_cluster_target});
+    T class_logsum_local = logSumExp(score_data, cluster_size);
+    T loss =
+      class_logsum_local - class_score_used.at({idx_in_cluster_target});
     class_logsum->at({i_batch}) = class_logsum_local;
-    // output
-    output += loss;
+    sample_output[i_batch] = loss;
   }
+  // output
+  for (int i_batch = 0; i_batch < batch_size; ++i_batch)
+    output += sample_output[i_batch];
   // return value
   lua_pushnumber(L, output);
   lua_pushnumber(L, n_valid);
@@ -96,6 +754,8 @@ int updateGradInput(lua_State* L) {
   auto gradInput      = luaGetFieldIfTensorChecked<T>(L, 1, "gradInput");
   auto cluster_weight = luaGetFieldIfTensorChecked<T>(L, 1, "cluster_weight");
   auto class_weight   = luaGetFieldIfTensorChecked<T>(L, 1, "class_weight");
+  auto cluster_score  = luaGetFieldIfTensorChecked<T>(L, 1, "cluster_score");
+  auto cluster_logsum = luaGetFieldIfTensorChecked<T>(L, 1, "cluster_logsum");
   auto class_score    = luaGetFieldIfTensorChecked<T>(L, 1, "class_score");
   auto class_logsum   = luaGetFieldIfTensorChecked<T>(L, 1, "class_logsum");
   auto mapping        = luaGetFieldIfTensorChecked<long>(L, 1, "mapping");
@@ -105,11 +765,30 @@ int updateGradInput(lua_State* L) {
     luaGetFieldIfTensorChecked<long>(L, 1, "class_start_indices");
   auto target     = luaGetTensorChecked<long>(L, 2);
   auto n_clusters = cluster_weight->size(0);
-  auto n_class    = class_weight->size(0);
   auto batch_size = gradInput->size(0);
   if (gradInput->ndims() == 1)
     batch_size = 1;
+  luaL_argcheck(L, gradInput->isContiguous(), 1,
+                "gradInput must be contiguous");
+  std::vector<char> skip;
+  skippedSamples(L, *target, batch_size, skip);
+  // cluster
+  updateGradInputCluster(*gradInput, *cluster_weight, *cluster_score,
+                         *cluster_logsum, *mapping, *target, batch_size,
+                         skip.data());
+  if (useGrouped(L, batch_size)) {
+    ClusterBuckets buckets;
+    bucketByCluster(*target, *mapping, batch_size, buckets, skip.data());
+    updateGradInputGrouped(buckets, *gradInput, *class_weight, *class_score,
+                           *class_logsum, *mapping, *target,
+                           *n_class_in_cluster, *class_start_indices,
+                           getBF16Weight(L));
+    return 0;
+  }
+#pragma omp parallel for if (batch_size > 1)
   for (int i_batch = 0; i_batch < batch_size; ++i_batch) {
+    if (skip[i_batch])
+      continue;
     long itarget = target->at({i_batch}) - 1; // 1based->0based
     long cluster_target = mapping->at({itarget, 0}) - 1; // 1based->0based
     long idx_in_cluster_target =
@@ -127,9 +806,8 @@ int updateGradInput(lua_State* L) {
     T class_logsum_local = class_logsum->at({i_batch});
     assert(class_score_used.isContiguous());
     T* score_data = class_score_used.data();
-    for (int d = 0; d < cluster_size; ++d)
-      score_data[d] = exp(score_data[d] - class_logsum_local);
-    score_data[idx_in_cluster_target] -= 1.;
+    nllGradient(score_data, cluster_size, class_logsum_local,
+                idx_in_cluster_target);
     //   compute gradInput of the addmv part
     Tensor<T> weight_t;
     weight_t.transpose(class_weight_used, 0, 1);
@@ -151,29 +829,62 @@ int accGradParameters(lua_State* L) {
     luaGetFieldIfTensorChecked<long>(L, 1, "n_class_in_cluster");
   auto class_start_indices =
     luaGetFieldIfTensorChecked<long>(L, 1, "class_start_indices");
+  auto class_grad_offset =
+    luaGetFieldIfTensor<long>(L, 1, "class_grad_offset");
   auto input      = luaGetTensorChecked<T>(L, 2);
   auto target     = luaGetTensorChecked<long>(L, 3);
   auto scale      = lua_tonumber(L, 4);
   auto batch_size = input->size(0);
   if (input->ndims() == 1)
     batch_size = 1;
+  std::vector<char> skip;
+  skippedSamples(L, *target, batch_size, skip);
+  ClusterBuckets buckets;
+  bucketByCluster(*target, *mapping, batch_size, buckets, skip.data());
+  // rows of the gradient buffers where each cluster starts
+  auto grad_start_indices = class_start_indices;
+  if (class_grad_offset) {
+    auto touched_clusters =
+      luaGetFieldIfTensorChecked<long>(L, 1, "touched_clusters");
+    auto n_touched = luaGetFieldIfTensorChecked<long>(L, 1, "n_touched");
+    touchClusters(buckets, *n_class_in_cluster, **class_grad_offset,
+                  *touched_clusters, *n_touched);
+    luaL_argcheck(L, n_touched->at({1}) <= class_grad_weight->size(0), 1,
+                  "class_grad_weight is too small for the touched clusters");
+    grad_start_indices = *class_grad_offset;
+  }
+  if (useGrouped(L, batch_size)) {
+    accGradParametersGrouped<T>(buckets, *input, *class_score,
+                                *class_grad_weight, *class_grad_bias,
+                                *n_class_in_cluster, *grad_start_indices,
+                                scale);
+    return 0;
+  }
   // class:
-  for (int i_batch = 0; i_batch < batch_size; ++i_batch) {
-    long itarget = target->at({i_batch}) - 1; // 1based->0based
-    long cluster_target = mapping->at({itarget, 0}) - 1; // 1based->0based
-    long idx_in_cluster_target =
-      mapping->at({itarget, 1}) - 1; // 1based->0based
-    long cluster_size = n_class_in_cluster->at({cluster_target});
-    Tensor<T> input_local = (input->ndims() == 1) ? *input : (*input)[i_batch];
-    //   get tensors corresponding to target
-    long istart = class_start_indices->at({cluster_target});
-    Tensor<T> class_score_used, class_grad_weight_used, class_grad_bias_used;
-    class_score_used.narrow((*class_score)[i_batch], 0, 0, cluster_size);
-    class_grad_weight_used.narrow(*class_grad_weight, 0, istart, cluster_size);
-    class_grad_bias_used.narrow(*class_grad_bias, 0, istart, cluster_size);
-    //   accumulate gradients
-    class_grad_weight_used.addr(1, scale, class_score_used, input_local);
-    class_grad_bias_used.cadd(scale, class_score_used);
+  //   each cluster is owned by a single thread, which accumulates the
+  //   gradients of its samples in batch order
+#pragma omp parallel for schedule(dynamic) if (buckets.size() > 1)
+  for (long b = 0; b < buckets.size(); ++b) {
+    for (long j = 0; j < buckets.bucketSize(b); ++j) {
+      long i_batch = buckets.samples(b)[j];
+      long itarget = target->at({i_batch}) - 1; // 1based->0based
+      long cluster_target = mapping->at({itarget, 0}) - 1; // 1based->0based
+      long idx_in_cluster_target =
+        mapping->at({itarget, 1}) - 1; // 1based->0based
+      long cluster_size = n_class_in_cluster->at({cluster_target});
+      Tensor<T> input_local =
+        (input->ndims() == 1) ? *input : (*input)[i_batch];
+      //   get tensors corresponding to target
+      long istart = grad_start_indices->at({cluster_target});
+      Tensor<T> class_score_used, class_grad_weight_used, class_grad_bias_used;
+      class_score_used.narrow((*class_score)[i_batch], 0, 0, cluster_size);
+      class_grad_weight_used.narrow(*class_grad_weight, 0, istart,
+                                    cluster_size);
+      class_grad_bias_used.narrow(*class_grad_bias, 0, istart, cluster_size);
+      //   accumulate gradients
+      class_grad_weight_used.addr(1, scale, class_score_used, input_local);
+      class_grad_bias_used.cadd(scale, class_score_used);
+    }
   }
   return 0;
 }
@@ -194,23 +905,68 @@ int accGradParameters_directUpdate(lua_State* L) {
   auto batch_size = input->size(0);
   if (input->ndims() == 1)
     batch_size = 1;
+  std::vector<char> skip;
+  skippedSamples(L, *target, batch_size, skip);
+  if (auto class_weight_bf16 =
+        luaGetFieldIfTensor<unsigned char>(L, 1, "class_weight_bf16")) {
+    luaL_argcheck(L, !luaGetFieldIfBoolean(L, 1, "hogwild").value_or(false),
+                  1, "hogwild updates need float class weights");
+    ClusterBuckets buckets;
+    bucketByCluster(*target, *mapping, batch_size, buckets, skip.data());
+    accGradParametersBF16<T>(buckets, *input, *class_score,
+                             **class_weight_bf16, *class_bias,
+                             *n_class_in_cluster, *class_start_indices,
+                             scale);
+    return 0;
+  }
+  if (luaGetFieldIfBoolean(L, 1, "hogwild").value_or(false)) {
+    auto n_hot =
+      luaGetFieldIfNumber<long>(L, 1, "hogwild_hot_clusters").value_or(0);
+    luaL_argcheck(L, n_hot >= 0, 1, "hogwild_hot_clusters must be >= 0");
+    ClusterBuckets buckets;
+    bucketByCluster(*target, *mapping, batch_size, buckets, skip.data());
+    accGradParametersHogwild<T>(buckets, *input, *class_score,
+                                *class_weight, *class_bias, *mapping,
+                                *target, *n_class_in_cluster,
+                                *class_start_indices, n_hot, batch_size,
+                                skip.data(), scale);
+    return 0;
+  }
+  if (useGrouped(L, batch_size)) {
+    ClusterBuckets buckets;
+    bucketByCluster(*target, *mapping, batch_size, buckets, skip.data());
+    accGradParametersGrouped<T>(buckets, *input, *class_score,
+                                *class_weight, *class_bias,
+                                *n_class_in_cluster, *class_start_indices,
+                                scale);
+    return 0;
+  }
   // class:
-  for (int i_batch = 0; i_batch < batch_size; ++i_batch) {
-    long itarget = target->at({i_batch}) - 1; // 1based->0based
-    long cluster_target = mapping->at({itarget, 0}) - 1; // 1based->0based
-    long idx_in_cluster_target =
-      mapping->at({itarget, 1}) - 1; // 1based->0based
-    long cluster_size = n_class_in_cluster->at({cluster_target});
-    Tensor<T> input_local = (input->ndims() == 1) ? *input : (*input)[i_batch];
-    //   get tensors corresponding to target
-    long istart = class_start_indices->at({cluster_target});
-    Tensor<T> class_score_used, class_weight_used, class_bias_used;
-    class_score_used.narrow((*class_score)[i_batch], 0, 0, cluster_size);
-    class_weight_used.narrow(*class_weight, 0, istart, cluster_size);
-    class_bias_used.narrow(*class_bias, 0, istart, cluster_size);
-    //   accumulate gradients
-    class_weight_used.addr(1, scale, class_score_used, input_local);
-    class_bias_used.cadd(scale, class_score_used);
+  //   each cluster is owned by a single thread, which accumulates the
+  //   gradients of its samples in batch order
+  ClusterBuckets buckets;
+  bucketByCluster(*target, *mapping, batch_size, buckets, skip.data());
+#pragma omp parallel for schedule(dynamic) if (buckets.size() > 1)
+  for (long b = 0; b < buckets.size(); ++b) {
+    for (long j = 0; j < buckets.bucketSize(b); ++j) {
+      long i_batch = buckets.samples(b)[j];
+      long itarget = target->at({i_batch}) - 1; // 1based->0based
+      long cluster_target = mapping->at({itarget, 0}) - 1; // 1based->0based
+      long idx_in_cluster_target =
+        mapping->at({itarget, 1}) - 1; // 1based->0based
+      long cluster_size = n_class_in_cluster->at({cluster_target});
+      Tensor<T> input_local =
+        (input->ndims() == 1) ? *input : (*input)[i_batch];
+      //   get tensors corresponding to target
+      long istart = class_start_indices->at({cluster_target});
+      Tensor<T> class_score_used, class_weight_used, class_bias_used;
+      class_score_used.narrow((*class_score)[i_batch], 0, 0, cluster_size);
+      class_weight_used.narrow(*class_weight, 0, istart, cluster_size);
+      class_bias_used.narrow(*class_bias, 0, istart, cluster_size);
+      //   accumulate gradients
+      class_weight_used.addr(1, scale, class_score_used, input_local);
+      class_bias_used.cadd(scale, class_score_used);
+    }
   }
   return 0;
 }
@@ -228,12 +984,13 @@ int zeroGradParametersClass(lua_State* L) {
     luaGetFieldIfTensorChecked<long>(L, 1, "class_start_indices");
   auto target     = luaGetTensorChecked<long>(L, 2);
   auto batch_size = target->size(0);
-  // TODO: be smarter and 0 out only once per cluster.
-  for (int i_batch = 0; i_batch < batch_size; ++i_batch) {
-    long itarget = target->at({i_batch}) - 1; // 1based->0based
-    long cluster_target = mapping->at({itarget, 0}) - 1; // 1based->0based
-    long idx_in_cluster_target =
-      mapping->at({itarget, 1}) - 1; // 1based->0based
+  std::vector<char> skip;
+  skippedSamples(L, *target, batch_size, skip);
+  // 0 out only once per cluster
+  ClusterBuckets buckets;
+  bucketByCluster(*target, *mapping, batch_size, buckets, skip.data());
+  for (long b = 0; b < buckets.size(); ++b) {
+    long cluster_target = buckets.clusters[b];
     long cluster_size = n_class_in_cluster->at({cluster_target});
     //   get tensors corresponding to target
     long istart = class_start_indices->at({cluster_target});
@@ -247,6 +1004,417 @@ int zeroGradParametersClass(lua_State* L) {
   return 0;
 }
 
+// Sparse mode: zeroes the rows of the compact gradient buffers used since
+// the last call, and forgets the touched clusters.
+template <class T>
+int zeroGradParametersTouched(lua_State* L) {
+  auto class_grad_weight   = luaGetFieldIfTensorChecked<T>(L, 1,
+                                                           "class_grad_weight");
+  auto class_grad_bias     = luaGetFieldIfTensorChecked<T>(L, 1,
+                                                           "class_grad_bias");
+  auto class_grad_offset =
+    luaGetFieldIfTensorChecked<long>(L, 1, "class_grad_offset");
+  auto touched_clusters =
+    luaGetFieldIfTensorChecked<long>(L, 1, "touched_clusters");
+  auto n_touched = luaGetFieldIfTensorChecked<long>(L, 1, "n_touched");
+  long n_rows = n_touched->at({1});
+  if (n_rows > 0) {
+    Tensor<T> class_grad_weight_used, class_grad_bias_used;
+    class_grad_weight_used.narrow(*class_grad_weight, 0, 0, n_rows);
+    class_grad_bias_used.narrow(*class_grad_bias, 0, 0, n_rows);
+    class_grad_weight_used.fill(0.0);
+    class_grad_bias_used.fill(0.0);
+  }
+  for (long i = 0; i < n_touched->at({0}); ++i)
+    class_grad_offset->at({touched_clusters->at({i})}) = -1;
+  n_touched->fill(0);
+  return 0;
+}
+
+// Sparse mode: class parameters -= learning_rate * gradients, for the
+// touched clusters only.
+template <class T>
+int updateParametersTouched(lua_State* L) {
+  auto class_weight   = luaGetFieldIfTensorChecked<T>(L, 1, "class_weight");
+  auto class_bias     = luaGetFieldIfTensorChecked<T>(L, 1, "class_bias");
+  auto class_grad_weight   = luaGetFieldIfTensorChecked<T>(L, 1,
+                                                           "class_grad_weight");
+  auto class_grad_bias     = luaGetFieldIfTensorChecked<T>(L, 1,
+                                                           "class_grad_bias");
+  auto n_class_in_cluster =
+    luaGetFieldIfTensorChecked<long>(L, 1, "n_class_in_cluster");
+  auto class_start_indices =
+    luaGetFieldIfTensorChecked<long>(L, 1, "class_start_indices");
+  auto class_grad_offset =
+    luaGetFieldIfTensorChecked<long>(L, 1, "class_grad_offset");
+  auto touched_clusters =
+    luaGetFieldIfTensorChecked<long>(L, 1, "touched_clusters");
+  auto n_touched = luaGetFieldIfTensorChecked<long>(L, 1, "n_touched");
+  T learning_rate = luaGetNumberChecked<T>(L, 2);
+  auto class_weight_bf16 =
+    luaGetFieldIfTensor<unsigned char>(L, 1, "class_weight_bf16");
+  long input_size = class_grad_weight->size(1);
+  long n_touched_clusters = n_touched->at({0});
+#pragma omp parallel for schedule(dynamic)
+  for (long i = 0; i < n_touched_clusters; ++i) {
+    long cluster = touched_clusters->at({i});
+    long cluster_size = n_class_in_cluster->at({cluster});
+    long istart = class_start_indices->at({cluster});
+    long igrad = class_grad_offset->at({cluster});
+    if (class_weight_bf16) {
+      std::vector<T> delta(input_size);
+      for (long d = 0; d < cluster_size; ++d) {
+        blas::copy(input_size,
+                   class_grad_weight->data() +
+                     (igrad + d) * class_grad_weight->stride(0),
+                   class_grad_weight->stride(1), delta.data(), 1);
+        for (long e = 0; e < input_size; ++e)
+          delta[e] *= -learning_rate;
+        addToBF16Rows(**class_weight_bf16, istart + d, 1, input_size,
+                      delta.data());
+        class_bias->at({istart + d}) -=
+          learning_rate * class_grad_bias->at({igrad + d});
+      }
+      continue;
+    }
+    for (long d = 0; d < cluster_size; ++d) {
+      blas::axpy(input_size, -learning_rate,
+                 class_grad_weight->data() +
+                   (igrad + d) * class_grad_weight->stride(0),
+                 class_grad_weight->stride(1),
+                 class_weight->data() + (istart + d) * class_weight->stride(0),
+                 class_weight->stride(1));
+      class_bias->at({istart + d}) -=
+        learning_rate * class_grad_bias->at({igrad + d});
+    }
+  }
+  return 0;
+}
+
+// Inference: the k most likely classes of each sample, without a target.
+// Clusters are visited by decreasing log-probability. Since the
+// log-probability of a class is at most the one of its cluster, the search
+// stops at the first cluster that cannot beat the current k-th best class,
+// and only the classes of the visited clusters are scored.
+// Fills `indices` (1-based classes) and `logprobs`, of size batch_size x k
+// (k if input is 1d), in decreasing order of log-probability.
+template <class T>
+int topK(lua_State* L) {
+  auto cluster_weight = luaGetFieldIfTensorChecked<T>(L, 1, "cluster_weight");
+  auto cluster_bias   = luaGetFieldIfTensorChecked<T>(L, 1, "cluster_bias");
+  auto class_weight   = luaGetFieldIfTensorChecked<T>(L, 1, "class_weight");
+  auto class_bias     = luaGetFieldIfTensorChecked<T>(L, 1, "class_bias");
+  auto n_class_in_cluster =
+    luaGetFieldIfTensorChecked<long>(L, 1, "n_class_in_cluster");
+  auto class_start_indices =
+    luaGetFieldIfTensorChecked<long>(L, 1, "class_start_indices");
+  auto class_of_row = luaGetFieldIfTensorChecked<long>(L, 1, "class_of_row");
+  auto input    = luaGetTensorChecked<T>(L, 2);
+  auto k        = luaGetNumberChecked<long>(L, 3);
+  auto indices  = luaGetTensorChecked<long>(L, 4);
+  auto logprobs = luaGetTensorChecked<T>(L, 5);
+  const BF16Weight* class_weight_bf16 = getBF16Weight(L);
+  long n_classes = class_bias->size(0);
+  long n_clusters = cluster_weight->size(0);
+  long input_size = cluster_weight->size(1);
+  luaL_argcheck(L, k >= 1 && k <= n_classes, 3,
+                "k must be between 1 and the number of classes");
+  luaL_argcheck(L, input->isContiguous(), 2, "input must be contiguous");
+  long batch_size = input->size(0);
+  if (input->ndims() == 1) {
+    batch_size = 1;
+    indices->resize(LongStorage{k});
+    logprobs->resize(LongStorage{k});
+  } else {
+    indices->resize(LongStorage{batch_size, k});
+    logprobs->resize(LongStorage{batch_size, k});
+  }
+  // cluster scores of the whole batch (input * cluster_weight^T)
+  std::vector<T> cluster_score(batch_size * n_clusters);
+  blas::gemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+             batch_size, n_clusters, input_size,
+             1, input->data(), input_size,
+             cluster_weight->data(), cluster_weight->stride(0),
+             0, cluster_score.data(), n_clusters);
+#pragma omp parallel
+  {
+    std::vector<long> order(n_clusters);
+    std::vector<T> class_score, weight_buf, work;
+    // min-heap of (log-probability, row in class_weight)
+    std::vector<std::pair<T, long>> best;
+    std::greater<std::pair<T, long>> worse;
+#pragma omp for
+    for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+      //   log-softmax of the cluster scores
+      T* cluster_logp = cluster_score.data() + i_batch * n_clusters;
+      for (long c = 0; c < n_clusters; ++c)
+        cluster_logp[c] += cluster_bias->at({c});
+      work.resize(n_clusters);
+      vml::logSoftMax(n_clusters, cluster_logp, cluster_logp, work.data());
+      for (long c = 0; c < n_clusters; ++c)
+        order[c] = c;
+      std::sort(order.begin(), order.end(), [&](long a, long b) {
+        return cluster_logp[a] > cluster_logp[b];
+      });
+      //   score the classes of the clusters that can still contribute
+      best.clear();
+      const T* input_data = input->data() + i_batch * input_size;
+      for (long c : order) {
+        if ((long)best.size() == k && cluster_logp[c] <= best.front().first)
+          break;
+        long cluster_size = n_class_in_cluster->at({c});
+        long istart = class_start_indices->at({c});
+        class_score.resize(cluster_size);
+        long ld;
+        const T* weight_data =
+          classWeightRows(*class_weight, class_weight_bf16, istart,
+                          cluster_size, input_size, weight_buf, ld);
+        blas::gemv(CblasRowMajor, CblasNoTrans, cluster_size, input_size,
+                   1, weight_data, ld, input_data, 1,
+                   0, class_score.data(), 1);
+        for (long d = 0; d < cluster_size; ++d)
+          class_score[d] += class_bias->at({istart + d});
+        work.resize(cluster_size);
+        vml::logSoftMax(cluster_size, class_score.data(), class_score.data(),
+                        work.data());
+        for (long d = 0; d < cluster_size; ++d) {
+          T logp = cluster_logp[c] + class_score[d];
+          if ((long)best.size() < k) {
+            best.emplace_back(logp, istart + d);
+            std::push_heap(best.begin(), best.end(), worse);
+          } else if (logp > best.front().first) {
+            std::pop_heap(best.begin(), best.end(), worse);
+            best.back() = std::make_pair(logp, istart + d);
+            std::push_heap(best.begin(), best.end(), worse);
+          }
+        }
+      }
+      //   write them in decreasing order
+      std::sort_heap(best.begin(), best.end(), worse);
+      long* indices_data = indices->data() + i_batch * k;
+      T* logprobs_data = logprobs->data() + i_batch * k;
+      for (long j = 0; j < k; ++j) {
+        indices_data[j] = class_of_row->at({best[j].second});
+        logprobs_data[j] = best[j].first;
+      }
+    }
+  }
+  return 0;
+}
+
+// Frequency-balanced clustering of the classes for a target mass of 1 / k
+// per cluster: the classes, sorted by decreasing frequency `p` (summing to
+// 1), are cut into consecutive clusters closed as soon as they reach the
+// target mass or `max_cluster_size` classes. Frequent classes thus end up
+// in small clusters. Fills `cluster_end` and returns the expected number of
+// rows scored per sample, n_clusters + sum_c p(c) * size(c).
+double balancedClusters(const std::vector<double>& p, double k,
+                        long max_cluster_size,
+                        std::vector<long>& cluster_end) {
+  long n_classes = p.size();
+  double target_mass = 1. / k;
+  double expected_size = 0.;
+  double mass = 0.;
+  long begin = 0;
+  cluster_end.clear();
+  for (long i = 0; i < n_classes; ++i) {
+    mass += p[i];
+    long size = i + 1 - begin;
+    if (mass >= target_mass || size == max_cluster_size ||
+        i == n_classes - 1) {
+      expected_size += mass * size;
+      cluster_end.push_back(i + 1);
+      begin = i + 1;
+      mass = 0.;
+    }
+  }
+  return cluster_end.size() + expected_size;
+}
+
+// Builds a mapping (in the format of nn.HSM) from the class frequencies:
+// scans the number of clusters for the frequency-balanced clustering with
+// the lowest expected cost. Fills `mapping` and returns the expected number
+// of rows (of size input_size) scored per sample, and the number of
+// clusters.
+template <class T>
+int buildMapping(lua_State* L) {
+  auto freqs   = luaGetTensorChecked<T>(L, 1);
+  auto max_cluster_size = luaGetNumberChecked<long>(L, 2);
+  auto mapping = luaGetTensorChecked<long>(L, 3);
+  luaL_argcheck(L, freqs->ndims() == 1, 1, "freqs must be a vector");
+  luaL_argcheck(L, max_cluster_size >= 1, 2,
+                "max_cluster_size must be positive");
+  long n_classes = freqs->size(0);
+  //   classes by decreasing frequency
+  std::vector<long> order(n_classes);
+  double total = 0.;
+  for (long i = 0; i < n_classes; ++i) {
+    order[i] = i;
+    luaL_argcheck(L, freqs->at({i}) >= 0, 1, "freqs must be non-negative");
+    total += freqs->at({i});
+  }
+  luaL_argcheck(L, total > 0, 1, "freqs must not be all zero");
+  std::stable_sort(order.begin(), order.end(), [&](long a, long b) {
+    return freqs->at({a}) > freqs->at({b});
+  });
+  std::vector<double> p(n_classes);
+  for (long i = 0; i < n_classes; ++i)
+    p[i] = freqs->at({order[i]}) / total;
+  //   scan k geometrically; the cost is at least the number of clusters, so
+  //   no k above the best cost can do better. For each k, also try capping
+  //   the cluster size at a few multiples of n_classes / k, which keeps the
+  //   rare classes from piling up in a few huge clusters.
+  std::vector<long> cluster_end, best_end;
+  double best_cost = std::numeric_limits<double>::infinity();
+  double k = (double)(n_classes + max_cluster_size - 1) / max_cluster_size;
+  for (; k <= n_classes && k < best_cost; k = std::max(k + 1, k * 1.05)) {
+    for (double factor : {1., 2., 4., 8., 0.}) {
+      long size_cap = max_cluster_size;
+      if (factor > 0)
+        size_cap = std::min(size_cap, (long)std::ceil(factor * n_classes / k));
+      double cost = balancedClusters(p, k, size_cap, cluster_end);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_end.swap(cluster_end);
+      }
+    }
+  }
+  //   write the mapping (1-based clusters and indices)
+  mapping->resize(LongStorage{n_classes, 2});
+  long begin = 0;
+  for (long c = 0; c < (long)best_end.size(); ++c) {
+    for (long i = begin; i < best_end[c]; ++i) {
+      mapping->at({order[i], 0}) = c + 1;
+      mapping->at({order[i], 1}) = i - begin + 1;
+    }
+    begin = best_end[c];
+  }
+  lua_pushnumber(L, best_cost);
+  lua_pushnumber(L, best_end.size());
+  return 2;
+}
+
+// Minibatch kernels of nn.ClassHierarchicalNLLCriterion, which is the same
+// two-level model with different field names (and parameter gradients
+// accumulated in updateGradInput).
+template <class T>
+int classHierarchicalUpdateOutput(lua_State* L) {
+  auto cluster_weight = luaGetFieldIfTensorChecked<T>(L, 1, "clusterMatrix");
+  auto cluster_bias   = luaGetFieldIfTensorChecked<T>(L, 1, "clusterBias");
+  auto class_weight   = luaGetFieldIfTensorChecked<T>(L, 1, "classMatrix");
+  auto class_bias     = luaGetFieldIfTensorChecked<T>(L, 1, "classBias");
+  auto cluster_score  = luaGetFieldIfTensorChecked<T>(L, 1, "clusterScore");
+  auto cluster_logsum = luaGetFieldIfTensorChecked<T>(L, 1, "clusterLogsum");
+  auto class_score    = luaGetFieldIfTensorChecked<T>(L, 1, "classScore");
+  auto class_logsum   = luaGetFieldIfTensorChecked<T>(L, 1, "classLogsum");
+  auto mapping      = luaGetFieldIfTensorChecked<long>(L, 1, "mappingLong");
+  auto class_count  =
+    luaGetFieldIfTensorChecked<long>(L, 1, "clusterCountsLong");
+  auto class_start  = luaGetFieldIfTensorChecked<long>(L, 1, "startIndexLong");
+  auto input  = luaGetTensorChecked<T>(L, 2);
+  auto target = luaGetTensorChecked<long>(L, 3);
+  luaL_argcheck(L, input->ndims() == 2 && input->isContiguous(), 2,
+                "input must be a contiguous matrix");
+  long batch_size = input->size(0);
+  T output = updateOutputCluster(*input, *cluster_weight, *cluster_bias,
+                                 *cluster_score, *cluster_logsum, *mapping,
+                                 *target, batch_size);
+  ClusterBuckets buckets;
+  bucketByCluster(*target, *mapping, batch_size, buckets);
+  output += updateOutputGrouped(buckets, *input, *class_weight, *class_bias,
+                                *class_score, *class_logsum, *mapping,
+                                *target, *class_count, *class_start);
+  lua_pushnumber(L, output);
+  return 1;
+}
+
+template <class T>
+int classHierarchicalUpdateGradInput(lua_State* L) {
+  auto gradInput      = luaGetFieldIfTensorChecked<T>(L, 1, "gradInput");
+  auto cluster_weight = luaGetFieldIfTensorChecked<T>(L, 1, "clusterMatrix");
+  auto class_weight   = luaGetFieldIfTensorChecked<T>(L, 1, "classMatrix");
+  auto cluster_grad_weight =
+    luaGetFieldIfTensorChecked<T>(L, 1, "clusterMatrixDx");
+  auto cluster_grad_bias = luaGetFieldIfTensorChecked<T>(L, 1, "clusterBiasDx");
+  auto class_grad_weight = luaGetFieldIfTensorChecked<T>(L, 1, "classMatrixDx");
+  auto class_grad_bias   = luaGetFieldIfTensorChecked<T>(L, 1, "classBiasDx");
+  auto cluster_score  = luaGetFieldIfTensorChecked<T>(L, 1, "clusterScore");
+  auto cluster_logsum = luaGetFieldIfTensorChecked<T>(L, 1, "clusterLogsum");
+  auto class_score    = luaGetFieldIfTensorChecked<T>(L, 1, "classScore");
+  auto class_logsum   = luaGetFieldIfTensorChecked<T>(L, 1, "classLogsum");
+  auto mapping      = luaGetFieldIfTensorChecked<long>(L, 1, "mappingLong");
+  auto class_count  =
+    luaGetFieldIfTensorChecked<long>(L, 1, "clusterCountsLong");
+  auto class_start  = luaGetFieldIfTensorChecked<long>(L, 1, "startIndexLong");
+  auto input  = luaGetTensorChecked<T>(L, 2);
+  auto target = luaGetTensorChecked<long>(L, 3);
+  luaL_argcheck(L, input->ndims() == 2 && input->isContiguous(), 2,
+                "input must be a contiguous matrix");
+  luaL_argcheck(L, gradInput->isContiguous(), 1,
+                "gradInput must be contiguous");
+  long batch_size = input->size(0);
+  long input_size = input->size(1);
+  long n_clusters = cluster_weight->size(0);
+  // cluster: gradInput, then the parameter gradients with one GEMM
+  updateGradInputCluster(*gradInput, *cluster_weight, *cluster_score,
+                         *cluster_logsum, *mapping, *target, batch_size);
+  blas::gemm(CblasRowMajor, CblasTrans, CblasNoTrans,
+             n_clusters, input_size, batch_size,
+             1, cluster_score->data(), n_clusters,
+             input->data(), input_size,
+             1, cluster_grad_weight->data(), cluster_grad_weight->stride(0));
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch)
+    blas::axpy(n_clusters, 1, cluster_score->data() + i_batch * n_clusters, 1,
+               cluster_grad_bias->data(), cluster_grad_bias->stride(0));
+  // class: one GEMM per chunk of a touched cluster, gradients in place
+  ClusterBuckets buckets;
+  bucketByCluster(*target, *mapping, batch_size, buckets);
+  updateGradInputGrouped(buckets, *gradInput, *class_weight, *class_score,
+                         *class_logsum, *mapping, *target, *class_count,
+                         *class_start);
+  accGradParametersGrouped<T>(buckets, *input, *class_score,
+                              *class_grad_weight, *class_grad_bias,
+                              *class_count, *class_start, 1);
+  return 0;
+}
+
+// dst (ByteTensor, n x 2d) = src (n x d), rounded to bfloat16.
+template <class T>
+int toBF16(lua_State* L) {
+  auto dst = luaGetTensorChecked<unsigned char>(L, 1);
+  auto src = luaGetTensorChecked<T>(L, 2);
+  luaL_argcheck(L, src->ndims() == 2, 2, "src must be a matrix");
+  long n_rows = src->size(0);
+  long n_cols = src->size(1);
+  dst->resize(LongStorage{n_rows, 2 * n_cols});
+#pragma omp parallel for
+  for (long i = 0; i < n_rows; ++i) {
+    uint16_t* row = bf16Row(*dst, i);
+    for (long d = 0; d < n_cols; ++d)
+      row[d] = floatToBF16(src->at({i, d}));
+  }
+  return 0;
+}
+
+// dst (n x d) = src (ByteTensor of bfloat16, n x 2d).
+template <class T>
+int fromBF16(lua_State* L) {
+  auto dst = luaGetTensorChecked<T>(L, 1);
+  auto src = luaGetTensorChecked<unsigned char>(L, 2);
+  luaL_argcheck(L, src->ndims() == 2 && src->isContiguous(), 2,
+                "src must be a contiguous matrix");
+  long n_rows = src->size(0);
+  long n_cols = src->size(1) / 2;
+  dst->resize(LongStorage{n_rows, n_cols});
+#pragma omp parallel for
+  for (long i = 0; i < n_rows; ++i) {
+    const uint16_t* row = bf16Row(*src, i);
+    for (long d = 0; d < n_cols; ++d)
+      dst->at({i, d}) = bf16ToFloat(row[d]);
+  }
+  return 0;
+}
+
 template <class T>
 class Registerer {
  private:
@@ -262,6 +1430,16 @@ const luaL_Reg Registerer<T>::functions_[] = {
   {"HSM_accGradParameters"             , accGradParameters<T>},
   {"HSM_accGradParameters_directUpdate", accGradParameters_directUpdate<T>},
   {"HSM_zeroGradParametersClass"       , zeroGradParametersClass<T>},
+  {"HSM_zeroGradParametersTouched"     , zeroGradParametersTouched<T>},
+  {"HSM_updateParametersTouched"       , updateParametersTouched<T>},
+  {"HSM_topK"                          , topK<T>},
+  {"HSM_buildMapping"                  , buildMapping<T>},
+  {"HSM_toBF16"                        , toBF16<T>},
+  {"HSM_fromBF16"                      , fromBF16<T>},
+  {"ClassHierarchicalNLLCriterion_updateOutput",
+   classHierarchicalUpdateOutput<T>},
+  {"ClassHierarchicalNLLCriterion_updateGradInput",
+   classHierarchicalUpdateGradInput<T>},
   {nullptr, nullptr},
 };
 
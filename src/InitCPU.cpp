@@ -9,12 +9,16 @@ namespace facebook { namespace deeplearning { namespace torch {
 
 void initCrossMapNormalization(lua_State* L);
 void initTemporalConvolutionTBC(lua_State* L);
+void initUnfoldedTemporalConvolution(lua_State* L);
 void initLocallyConnected(lua_State* L);
 void initKMaxPooling(lua_State* L);
 void initGroupKMaxPooling(lua_State* L);
 void initHSM(lua_State* L);
+void initTreeHSM(lua_State* L);
+void initSampledSoftMax(lua_State* L);
 void initSparseNLLCriterion(lua_State* L);
 void initWeightedLookupTable(lua_State* L);
+void initLogSumExp(lua_State* L);
 
 }}}  // namespace
 
@@ -23,11 +27,15 @@ using namespace facebook::deeplearning::torch;
 extern "C" int LUAOPEN(lua_State* L) {
   initCrossMapNormalization(L);
   initTemporalConvolutionTBC(L);
+  initUnfoldedTemporalConvolution(L);
   initLocallyConnected(L);
   initKMaxPooling(L);
   initGroupKMaxPooling(L);
   initHSM(L);
+  initTreeHSM(L);
+  initSampledSoftMax(L);
   initSparseNLLCriterion(L);
   initWeightedLookupTable(L);
+  initLogSumExp(L);
   return 0;
 }
@@ -6,15 +6,11 @@
 #include <lua.hpp>
 #include <luaT.h>
 
+#include <algorithm>
 #include <vector>
-#include <queue>
 #include <utility>
 #include <stdexcept>
 
-// Turn off range checking for multi_array indexing
-#define BOOST_DISABLE_ASSERTS
-#include <boost/multi_array.hpp>
-
 #include "fblualib/LuaUtils.h"
 #include "thpp/Storage.h"
 #include "thpp/Tensor.h"
@@ -26,73 +22,135 @@ using namespace thpp;
 
 namespace {
 
-template<typename T>
-struct index_value : public std::pair<long, T> {
-  index_value(long const& i, T const& v): std::pair<long, T>(i, v) {}
-  long const& index() const { return this->first; }
-  T const& value() const { return this->second; }
-};
-
-template<typename T>
-inline index_value<T> make_index_value(long const& i, T const& v) {
-  return index_value<T>(i, v);
-}
+// Columns processed together by a thread in updateOutput.
+constexpr long kColumnTile = 256;
 
-template<typename T>
-struct value_order {
-  bool operator()(index_value<T> const& a, index_value<T> const& b) {
-    return a.value() > b.value();
+// Running top-k of each column of a tile of `n_cols` columns, fed one input
+// row at a time. Column c keeps its (at most k) values and row indices in
+// the contiguous slots [c * k, (c + 1) * k) of `values` and `rows`, and the
+// value it would evict next in `threshold[c]`, so that the test of a whole
+// input row is a contiguous comparison against `threshold`, which rarely
+// succeeds once the buffers are full. Ties go to the earliest rows.
+template <class T>
+class ColumnTopK {
+ public:
+  ColumnTopK(long k, long n_cols)
+      : k_(k),
+        n_cols_(n_cols),
+        values_(k * n_cols),
+        rows_(k * n_cols),
+        threshold_(n_cols),
+        evict_(n_cols),
+        hits_(n_cols) {}
+
+  // Fills the slots with the first k rows (input_row(r) is row r of the
+  // tile).
+  template <class RowFn>
+  void init(RowFn input_row) {
+    for (long r = 0; r < k_; ++r) {
+      const T* x = input_row(r);
+      for (long c = 0; c < n_cols_; ++c) {
+        values_[c * k_ + r] = x[c];
+        rows_[c * k_ + r] = r;
+      }
+    }
+    for (long c = 0; c < n_cols_; ++c)
+      findEvict(c);
   }
-};
 
-template<typename T>
-struct index_order {
-  bool operator()(index_value<T> const& a, index_value<T> const& b) {
-    return a.index() < b.index();
+  // Offers row `row` (later than all the rows seen so far) to each column.
+  void push(const T* x, long row) {
+    const T* threshold = threshold_.data();
+    long n_hits = 0;
+    for (long c = 0; c < n_cols_; ++c) {
+      hits_[n_hits] = c;
+      n_hits += x[c] > threshold[c];
+    }
+    for (long h = 0; h < n_hits; ++h) {
+      long c = hits_[h];
+      long slot = c * k_ + evict_[c];
+      values_[slot] = x[c];
+      rows_[slot] = row;
+      findEvict(c);
+    }
   }
-};
-
-template<typename T>
-using array_view = boost::multi_array_ref<T, 2>;
 
-template<typename T>
-using array_col_view = typename array_view<T>::template array_view<1>::type;
+  // Writes the kept values of each column and their rows, in row order, to
+  // column `col_offset + c` of the row-major `output` and `switches` (with
+  // `ld` columns).
+  void write(T* output, long* switches, long ld, long col_offset) {
+    std::vector<std::pair<long, T>> column(k_);
+    for (long c = 0; c < n_cols_; ++c) {
+      for (long s = 0; s < k_; ++s)
+        column[s] = std::make_pair(rows_[c * k_ + s], values_[c * k_ + s]);
+      std::sort(column.begin(), column.end(),
+                [](const std::pair<long, T>& a, const std::pair<long, T>& b) {
+                  return a.first < b.first;
+                });
+      for (long s = 0; s < k_; ++s) {
+        output[s * ld + col_offset + c] = column[s].second;
+        switches[s * ld + col_offset + c] = column[s].first;
+      }
+    }
+  }
 
-template<typename T>
-boost::multi_array_ref<T, 2> tensor_array_view(Tensor<T>& tensor) {
-  return boost::multi_array_ref<T, 2>(
-    tensor.data(),
-    boost::extents[tensor.size(0)][tensor.size(1)]);
-}
+ private:
+  // The slot to evict next: the smallest value, and the latest row among
+  // equal values.
+  void findEvict(long c) {
+    const T* v = values_.data() + c * k_;
+    const long* r = rows_.data() + c * k_;
+    long best = 0;
+    for (long s = 1; s < k_; ++s) {
+      if (v[s] < v[best] || (v[s] == v[best] && r[s] > r[best]))
+        best = s;
+    }
+    evict_[c] = best;
+    threshold_[c] = v[best];
+  }
 
-template<typename T>
-boost::const_multi_array_ref<T, 2> tensor_array_view(Tensor<T> const& tensor) {
-  return boost::const_multi_array_ref<T, 2>(
-    tensor.data(),
-    boost::extents[tensor.size(0)][tensor.size(1)]);
-}
+  long k_;
+  long n_cols_;
+  std::vector<T> values_;
+  std::vector<long> rows_;
+  std::vector<T> threshold_;
+  std::vector<long> evict_;
+  std::vector<long> hits_;
+};
 
-template<typename T>
-boost::multi_array_ref<T, 1> tensor_vector_view(Tensor<T>& tensor) {
-  return boost::multi_array_ref<T, 1>(
-    tensor.data(),
-    boost::extents[tensor.size(0)]);
+// Checks that `input` is a single sentence (length x features) or a batch
+// of sentences (batch x length x features) with one length each in
+// `input_length`, and returns the number of sentences.
+template <class T>
+long checkBatch(lua_State* L, const Tensor<T>& input,
+                const Tensor<long>& input_length) {
+  luaL_argcheck(L, input.ndims() == 2 || input.ndims() == 3, 1,
+    "input must have 2 or 3 dimensions.");
+  long batch_size = (input.ndims() == 3) ? input.size(0) : 1;
+  luaL_argcheck(L, input_length.ndims() == 1, 1,
+    "input_length must have exactly 1 dimension");
+  luaL_argcheck(L, input_length.size() == batch_size, 1,
+    "input_length must have one element per sentence");
+  for (long b = 0; b < batch_size; ++b) {
+    long length = input_length.at({b});
+    luaL_argcheck(L, length >= 0 && length <= input.size(input.ndims() - 2),
+                  1, "input_length is out of range");
+  }
+  return batch_size;
 }
 
-template<typename T>
-boost::const_multi_array_ref<T, 1> tensor_vector_view(Tensor<T> const& tensor) {
-  return boost::const_multi_array_ref<T, 1>(
-    tensor.data(),
-    boost::extents[tensor.size(0)]);
+template <class T>
+bool sameSize(const Tensor<T>& a, const Tensor<T>& b) {
+  if (a.ndims() != b.ndims())
+    return false;
+  for (int d = 0; d < a.ndims(); ++d) {
+    if (a.size(d) != b.size(d))
+      return false;
+  }
+  return true;
 }
 
-template<typename T>
-using value_priority_queue = std::priority_queue<
-  index_value<T>,
-  std::vector<index_value<T>>,
-  value_order<T>>;
-
-// Forward pass
+// Forward pass. The sentences of a batch are pooled in parallel.
 template <class T>
 int updateOutput(lua_State* L) {
   auto const input_tensor = luaGetTensorChecked<T>(L, 2);
@@ -106,12 +164,9 @@ int updateOutput(lua_State* L) {
   auto output_tensor = luaGetFieldIfTensorChecked<T>(L, 1, "output");
   int outputIdx = lua_gettop(L);
 
-  luaL_argcheck(L, input_tensor->ndims() == 2, 1,
-    "input must have exactly 2 dimensions.");
-  luaL_argcheck(L, input_length_tensor->ndims() == 1, 1,
-    "input_length must have exactly 1 dimension");
-  luaL_argcheck(L, input_length_tensor->size() == 1, 1,
-    "input_length must have exactly 1 element");
+  long batch_size = checkBatch(L, *input_tensor, *input_length_tensor);
+  luaL_argcheck(L, input_tensor->isContiguous(), 1,
+    "input must be contiguous");
 
   // Set k for dynamic k-max pooling
   if (k_dynamic > 0) {
@@ -121,76 +176,67 @@ int updateOutput(lua_State* L) {
         static_cast<long>(k_dynamic * input_tensor->size(sentence_dim)));
   }
 
-  output_tensor->resize(LongStorage{k, input_tensor->size(1)});
-  switches_tensor->resize(LongStorage{k, input_tensor->size(1)});
+  long max_length = input_tensor->size(input_tensor->ndims() - 2);
+  long n_cols = input_tensor->size(input_tensor->ndims() - 1);
+  if (input_tensor->ndims() == 3) {
+    output_tensor->resize(LongStorage{batch_size, k, n_cols});
+    switches_tensor->resize(LongStorage{batch_size, k, n_cols});
+  } else {
+    output_tensor->resize(LongStorage{k, n_cols});
+    switches_tensor->resize(LongStorage{k, n_cols});
+  }
+  output_length_tensor->resize(LongStorage{batch_size});
   output_tensor->fill(0.0);
   switches_tensor->fill(0);
 
-  auto input_data = tensor_array_view(*input_tensor);
-  auto output_data = tensor_array_view(*output_tensor);
-  auto switches_data = tensor_array_view(*switches_tensor);
-  auto input_length_data = tensor_vector_view(*input_length_tensor);
-  auto output_length_data = tensor_vector_view(*output_length_tensor);
-
-  for (int col = 0; col < input_tensor->size(1); ++col) {
-    value_priority_queue<T> kmax;
-
-    // extract the k-max values with indices
-    // for (int row = 0; row < input_tensor->size(0); ++row) {
-    for (int row = 0; row < input_length_data[0]; ++row) {
-      T value = input_data[row][col];
-
-      if (kmax.size() < k || value > kmax.top().value()) {
-        kmax.push(make_index_value(row, value));
-
-        if (kmax.size() > k) {
-          kmax.pop();
-        }
+  long n_tiles = (n_cols + kColumnTile - 1) / kColumnTile;
+  long n_tasks = batch_size * n_tiles;
+  #pragma omp parallel for schedule(dynamic) \
+    if (n_tasks > 1 && batch_size * max_length * n_cols > 100000)
+  for (long task = 0; task < n_tasks; ++task) {
+    long b = task / n_tiles;
+    long tile = task % n_tiles;
+    long length = input_length_tensor->at({b});
+    // with fewer than k rows, all of them are kept
+    long n_kept = std::min(length, k);
+    const T* input = input_tensor->data() + b * max_length * n_cols;
+    T* output = output_tensor->data() + b * k * n_cols;
+    long* switches = switches_tensor->data() + b * k * n_cols;
+    long col_offset = tile * kColumnTile;
+    long tile_cols = std::min(kColumnTile, n_cols - col_offset);
+    if (n_kept < k) {
+      for (long row = 0; row < n_kept; ++row) {
+        long offset = row * n_cols + col_offset;
+        std::copy(input + offset, input + offset + tile_cols,
+                  output + offset);
+        std::fill(switches + offset, switches + offset + tile_cols, row);
       }
-    }
-
-    // re-order k-max into input order
-    std::vector<index_value<T>> kmax_sorted;
-    while (!kmax.empty()) {
-      kmax_sorted.push_back(kmax.top());
-      kmax.pop();
-    }
-    std::sort(
-      kmax_sorted.begin(),
-      kmax_sorted.end(),
-      index_order<T>());
-
-    // copy the k-max values to the output
-    array_col_view<T> output_col = output_data[
-      boost::indices[typename array_view<T>::index_range()][col]];
-    std::transform(
-      kmax_sorted.begin(),
-      kmax_sorted.end(),
-      output_col.begin(),
-      [](index_value<T> const& v) -> T {
-        return v.value();
-      });
-
-    // copy the k-max indices into switches
-    array_col_view<long> switches_col = switches_data[
-      boost::indices[typename array_view<long>::index_range()][col]];
-    std::transform(
-      kmax_sorted.begin(),
-      kmax_sorted.end(),
-      switches_col.begin(),
-      [](index_value<T> const& v) -> long {
-        return v.index();
+    } else if (k > 0) {
+      ColumnTopK<T> topk(k, tile_cols);
+      topk.init([&](long row) {
+        return input + row * n_cols + col_offset;
       });
+      for (long row = k; row < length; ++row)
+        topk.push(input + row * n_cols + col_offset, row);
+      topk.write(output, switches, n_cols, col_offset);
+    }
   }
 
-  // update length after pooling
-  output_length_data[0] = std::min(input_length_data[0], k);
+  // update lengths after pooling
+  for (long b = 0; b < batch_size; ++b)
+    output_length_tensor->at({b}) =
+      std::min(input_length_tensor->at({b}), k);
 
   lua_pushvalue(L, outputIdx);
   return 1;
 }
 
-// Backprop
+// Backprop. The sentences of a batch are handled in parallel.
+// With `sparse_backward`, gradInput is cleared by zeroing the entries
+// written by the previous call (kept in `grad_switches` and `grad_length`)
+// when its size did not change, so that the cost is proportional to k
+// rather than to the input length. gradInput must then not be modified
+// between calls.
 template <class T>
 int updateGradInput(lua_State* L) {
   auto const input = luaGetTensorChecked<T>(L, 2);
@@ -204,29 +250,58 @@ int updateGradInput(lua_State* L) {
   auto gradInput_tensor = luaGetFieldIfTensorChecked<T>(L, 1, "gradInput");
   int gradInputIdx = lua_gettop(L);
 
-  luaL_argcheck(L, gradOutput_tensor->ndims() == 2, 1,
-    "gradOutput must have exactly 2 dimensions.");
-  luaL_argcheck(L, input_length_tensor->ndims() == 1, 1,
-    "input_length must have exactly 1 dimension");
-  luaL_argcheck(L, input_length_tensor->size() == 1, 1,
-    "input_length must have exactly 1 element");
-
-  long output_length = output_length_tensor->front();
-
-  gradInput_tensor->resizeAs(*input);
-  gradInput_tensor->fill(0.0);
-
-  auto gradInput_data = tensor_array_view(*gradInput_tensor);
-  auto const gradOutput_data = tensor_array_view(*gradOutput_tensor);
-  auto const switches_data = tensor_array_view(*switches_tensor);
+  long batch_size = checkBatch(L, *input, *input_length_tensor);
+  luaL_argcheck(L, gradOutput_tensor->ndims() == input->ndims(), 1,
+    "gradOutput must have as many dimensions as input.");
+  luaL_argcheck(L, gradOutput_tensor->isContiguous(), 1,
+    "gradOutput must be contiguous");
+
+  long max_length = input->size(input->ndims() - 2);
+  long n_cols = gradOutput_tensor->size(gradOutput_tensor->ndims() - 1);
+  long k = gradOutput_tensor->size(gradOutput_tensor->ndims() - 2);
+
+  bool sparse = luaGetFieldIfBoolean(L, 1, "sparse_backward").value_or(false);
+  auto grad_switches = luaGetFieldIfTensor<long>(L, 1, "grad_switches");
+  auto grad_length = luaGetFieldIfTensor<long>(L, 1, "grad_length");
+  sparse = sparse && grad_switches && grad_length;
+  if (sparse && sameSize(*gradInput_tensor, *input) &&
+      (*grad_switches)->ndims() == input->ndims()) {
+    const Tensor<long>& prev_switches = **grad_switches;
+    long prev_k = prev_switches.size(prev_switches.ndims() - 2);
+    #pragma omp parallel for if (batch_size > 1)
+    for (long b = 0; b < batch_size; ++b) {
+      T* gradInput = gradInput_tensor->data() + b * max_length * n_cols;
+      const long* switches = prev_switches.data() + b * prev_k * n_cols;
+      long row_limit = std::min((*grad_length)->at({b}), prev_k);
+      for (long row = 0; row < row_limit; ++row) {
+        for (long col = 0; col < n_cols; ++col)
+          gradInput[switches[row * n_cols + col] * n_cols + col] = 0.;
+      }
+    }
+  } else {
+    gradInput_tensor->resizeAs(*input);
+    gradInput_tensor->fill(0.0);
+  }
 
-  long row_limit = std::min(output_length, gradOutput_tensor->size(0));
-  for (int row = 0; row < row_limit; ++row) {
-    for (int col = 0; col < gradOutput_tensor->size(1); ++col) {
-      long input_row = switches_data[row][col];
-      gradInput_data[input_row][col] = gradOutput_data[row][col];
+  #pragma omp parallel for if (batch_size > 1)
+  for (long b = 0; b < batch_size; ++b) {
+    T* gradInput = gradInput_tensor->data() + b * max_length * n_cols;
+    const T* gradOutput = gradOutput_tensor->data() + b * k * n_cols;
+    const long* switches = switches_tensor->data() + b * k * n_cols;
+    long row_limit = std::min(output_length_tensor->at({b}), k);
+    for (long row = 0; row < row_limit; ++row) {
+      for (long col = 0; col < n_cols; ++col) {
+        long input_row = switches[row * n_cols + col];
+        gradInput[input_row * n_cols + col] = gradOutput[row * n_cols + col];
+      }
     }
   }
+  if (sparse) {
+    (*grad_switches)->resizeAs(*switches_tensor);
+    (*grad_switches)->copy(*switches_tensor);
+    (*grad_length)->resizeAs(*output_length_tensor);
+    (*grad_length)->copy(*output_length_tensor);
+  }
 
   lua_pushvalue(L, gradInputIdx);
   return 1;
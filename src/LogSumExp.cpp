@@ -0,0 +1,204 @@
+/**
+ * Copyright 2015 Facebook
+ */
+
+#include <vector>
+
+#include <lua.hpp>
+#include <luaT.h>
+
+#include "fblualib/LuaUtils.h"
+#include "thpp/Storage.h"
+#include "thpp/Tensor.h"
+
+#include "Vml.h"
+
+namespace facebook { namespace deeplearning { namespace torch {
+
+using namespace fblualib;
+using namespace thpp;
+
+namespace {
+
+// output[i][0] = log(sum_j exp(input[i][j])), for a contiguous 2d input.
+template <class T>
+int logSumExpRows(lua_State* L) {
+  auto output = luaGetTensorChecked<T>(L, 1);
+  auto const input = luaGetTensorChecked<T>(L, 2);
+  luaL_argcheck(L, input->ndims() == 2 && input->isContiguous(), 2,
+                "input must be a contiguous matrix");
+  long n_rows = input->size(0);
+  long n_cols = input->size(1);
+  output->resize(LongStorage{n_rows, 1});
+
+  #pragma omp parallel if(n_rows * n_cols > 100000)
+  {
+    std::vector<T> work(n_cols);
+    #pragma omp for
+    for (long i = 0; i < n_rows; ++i) {
+      output->at({i, 0}) =
+        vml::logSumExp(n_cols, input->data() + i * n_cols, work.data());
+    }
+  }
+
+  return 0;
+}
+
+// output[i][j] = exp(input[i][j] - shift[i]), for a contiguous 2d input.
+// With shift = logSumExpRows(input), this is the row-wise softmax.
+template <class T>
+int expShiftedRows(lua_State* L) {
+  auto output = luaGetTensorChecked<T>(L, 1);
+  auto const input = luaGetTensorChecked<T>(L, 2);
+  auto const shift = luaGetTensorChecked<T>(L, 3);
+  luaL_argcheck(L, input->ndims() == 2 && input->isContiguous(), 2,
+                "input must be a contiguous matrix");
+  long n_rows = input->size(0);
+  long n_cols = input->size(1);
+  luaL_argcheck(L, shift->size() == n_rows, 3,
+                "shift must have one element per row");
+  output->resize(LongStorage{n_rows, n_cols});
+
+  #pragma omp parallel for if(n_rows * n_cols > 100000)
+  for (long i = 0; i < n_rows; ++i) {
+    vml::expShifted(n_cols, input->data() + i * n_cols,
+                    shift->data()[i * shift->stride(0)],
+                    output->data() + i * n_cols);
+  }
+
+  return 0;
+}
+
+// output = row-wise softmax of a contiguous 2d input. If `lse` is given,
+// it is set to the log-sum-exp of each row (n_rows x 1).
+template <class T>
+int softMaxRows(lua_State* L) {
+  auto output = luaGetTensorChecked<T>(L, 1);
+  auto const input = luaGetTensorChecked<T>(L, 2);
+  auto lse = luaGetTensor<T>(L, 3);
+  luaL_argcheck(L, input->ndims() == 2 && input->isContiguous(), 2,
+                "input must be a contiguous matrix");
+  long n_rows = input->size(0);
+  long n_cols = input->size(1);
+  output->resize(LongStorage{n_rows, n_cols});
+  if (lse) {
+    (*lse)->resize(LongStorage{n_rows, 1});
+  }
+
+  #pragma omp parallel for if(n_rows * n_cols > 100000)
+  for (long i = 0; i < n_rows; ++i) {
+    T logsum = vml::softMax(n_cols, input->data() + i * n_cols,
+                            output->data() + i * n_cols);
+    if (lse) {
+      (*lse)->at({i, 0}) = logsum;
+    }
+  }
+
+  return 0;
+}
+
+// output = row-wise log-softmax of a contiguous 2d input.
+template <class T>
+int logSoftMaxRows(lua_State* L) {
+  auto output = luaGetTensorChecked<T>(L, 1);
+  auto const input = luaGetTensorChecked<T>(L, 2);
+  luaL_argcheck(L, input->ndims() == 2 && input->isContiguous(), 2,
+                "input must be a contiguous matrix");
+  long n_rows = input->size(0);
+  long n_cols = input->size(1);
+  output->resize(LongStorage{n_rows, n_cols});
+
+  #pragma omp parallel if(n_rows * n_cols > 100000)
+  {
+    std::vector<T> work(n_cols);
+    #pragma omp for
+    for (long i = 0; i < n_rows; ++i) {
+      vml::logSoftMax(n_cols, input->data() + i * n_cols,
+                      output->data() + i * n_cols, work.data());
+    }
+  }
+
+  return 0;
+}
+
+// gradInput = gradient wrt the input of the row-wise softmax (or
+// log-softmax, with `log`), given its contiguous output and gradOutput.
+template <class T>
+int softMaxBackwardRows(lua_State* L, bool log) {
+  auto gradInput = luaGetTensorChecked<T>(L, 1);
+  auto const output = luaGetTensorChecked<T>(L, 2);
+  auto const gradOutput = luaGetTensorChecked<T>(L, 3);
+  luaL_argcheck(L, output->ndims() == 2 && output->isContiguous(), 2,
+                "output must be a contiguous matrix");
+  long n_rows = output->size(0);
+  long n_cols = output->size(1);
+  luaL_argcheck(L, gradOutput->ndims() == 2 && gradOutput->isContiguous() &&
+                gradOutput->size(0) == n_rows &&
+                gradOutput->size(1) == n_cols, 3,
+                "gradOutput must be a contiguous matrix of the output size");
+  gradInput->resize(LongStorage{n_rows, n_cols});
+
+  #pragma omp parallel if(n_rows * n_cols > 100000)
+  {
+    std::vector<T> work(n_cols);
+    #pragma omp for
+    for (long i = 0; i < n_rows; ++i) {
+      const T* y = output->data() + i * n_cols;
+      const T* gy = gradOutput->data() + i * n_cols;
+      T* gx = gradInput->data() + i * n_cols;
+      if (log) {
+        vml::logSoftMaxBackward(n_cols, y, gy, gx, work.data());
+      } else {
+        vml::softMaxBackward(n_cols, y, gy, gx);
+      }
+    }
+  }
+
+  return 0;
+}
+
+template <class T>
+int softMaxBackward(lua_State* L) {
+  return softMaxBackwardRows<T>(L, false);
+}
+
+template <class T>
+int logSoftMaxBackward(lua_State* L) {
+  return softMaxBackwardRows<T>(L, true);
+}
+
+template <class T>
+class Registerer {
+ private:
+  static const luaL_Reg functions_[];
+
+ public:
+  static void registerFunctions(lua_State* L);
+};
+
+template <class T>
+const luaL_Reg Registerer<T>::functions_[] = {
+  {"LogSumExp_rows", logSumExpRows<T>},
+  {"LogSumExp_expShiftedRows", expShiftedRows<T>},
+  {"LogSumExp_softMaxRows", softMaxRows<T>},
+  {"LogSumExp_logSoftMaxRows", logSoftMaxRows<T>},
+  {"LogSumExp_softMaxBackwardRows", softMaxBackward<T>},
+  {"LogSumExp_logSoftMaxBackwardRows", logSoftMaxBackward<T>},
+  {nullptr, nullptr},
+};
+
+template <class T>
+void Registerer<T>::registerFunctions(lua_State* L) {
+  luaT_pushmetatable(L, Tensor<T>::kLuaTypeName);
+  luaT_registeratname(L, functions_, "nn");
+  lua_pop(L, 1);
+}
+
+}  // namespace
+
+void initLogSumExp(lua_State* L) {
+  Registerer<float>::registerFunctions(L);
+  Registerer<double>::registerFunctions(L);
+}
+
+}}}  // namespaces
@@ -0,0 +1,330 @@
+// Copyright 2004-present Facebook. All Rights Reserved.
+
+// Sampled softmax and NCE over a flat class weight matrix (see
+// fbnn/SampledSoftMax.lua). Each sample scores its target and a set of
+// `n_samples` negative classes shared by the whole batch, so a batch costs
+// O(batch x (1 + n_samples) x input_size) instead of
+// O(batch x n_classes x input_size). The gradients only touch the rows of
+// the targets and of the sampled classes, which are recorded in
+// `touched_rows` so that zeroGradParameters and updateParameters only visit
+// them.
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <lua.hpp>
+#include <mkl.h>
+#include <luaT.h>
+#ifndef __clang__
+#include <omp.h>
+#endif
+
+#include "Blas.h"
+#include "Vml.h"
+
+#include "fblualib/LuaUtils.h"
+#include "thpp/Storage.h"
+#include "thpp/Tensor.h"
+
+namespace facebook {
+namespace deeplearning {
+namespace torch {
+
+using namespace fblualib;
+using namespace thpp;
+
+namespace {
+
+// log(1 + exp(x)), without overflow.
+template <class T>
+T softPlus(T x) {
+  return std::max(x, T(0)) + std::log1p(std::exp(-std::abs(x)));
+}
+
+template <class T>
+T sigmoid(T x) {
+  return 1. / (1. + std::exp(-x));
+}
+
+// Adds row `row` (1-based) to the touched rows, unless it already is.
+void touchRow(Tensor<long>& touched_rows, Tensor<unsigned char>& row_touched,
+              Tensor<long>& n_touched, long row) {
+  if (row_touched.at({row - 1})) // 1based->0based
+    return;
+  row_touched.at({row - 1}) = 1;
+  touched_rows.at({n_touched.at({0})}) = row;
+  n_touched.at({0}) += 1;
+}
+
+// Fills `score` (batch_size x (1 + n_samples)) with the corrected logits of
+// the target (column 0) and of the sampled classes, s - log(expected count
+// of the class in the samples), and returns the loss. Sampled classes that
+// are the target of a sample are masked out for that sample.
+template <class T>
+int updateOutput(lua_State* L) {
+  auto weight        = luaGetFieldIfTensorChecked<T>(L, 1, "weight");
+  auto bias          = luaGetFieldIfTensorChecked<T>(L, 1, "bias");
+  auto score         = luaGetFieldIfTensorChecked<T>(L, 1, "score");
+  auto logsum        = luaGetFieldIfTensorChecked<T>(L, 1, "logsum");
+  auto sample_weight = luaGetFieldIfTensorChecked<T>(L, 1, "sample_weight");
+  auto log_prob      = luaGetFieldIfTensorChecked<T>(L, 1, "log_prob");
+  auto sample_ids    = luaGetFieldIfTensorChecked<long>(L, 1, "sample_ids");
+  bool nce = luaGetFieldIfBoolean(L, 1, "nce").value_or(false);
+  auto input  = luaGetTensorChecked<T>(L, 2);
+  auto target = luaGetTensorChecked<long>(L, 3);
+  luaL_argcheck(L, input->isContiguous(), 2, "input must be contiguous");
+  long input_size = weight->size(1);
+  long n_samples = sample_ids->size(0);
+  long batch_size = input->size(0);
+  if (input->ndims() == 1)
+    batch_size = 1;
+  long n_scores = 1 + n_samples;
+  T log_n_samples = std::log(T(n_samples));
+  score->resize(LongStorage{batch_size, n_scores});
+  logsum->resize(LongStorage{batch_size});
+  sample_weight->resize(LongStorage{n_samples, input_size});
+
+  // rows of the sampled classes, shared by the whole batch
+  for (long j = 0; j < n_samples; ++j)
+    blas::copy(input_size,
+               weight->data() + (sample_ids->at({j}) - 1) * weight->stride(0),
+               weight->stride(1), sample_weight->data() + j * input_size, 1);
+  blas::gemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+             batch_size, n_samples, input_size,
+             1, input->data(), input_size,
+             sample_weight->data(), input_size,
+             0, score->data() + 1, n_scores);
+  std::vector<T> sample_shift(n_samples);
+  for (long j = 0; j < n_samples; ++j) {
+    long id = sample_ids->at({j}) - 1; // 1based->0based
+    sample_shift[j] = bias->at({id}) - log_n_samples - log_prob->at({id});
+  }
+
+  // per-sample losses, summed in a fixed order below
+  std::vector<T> sample_output(batch_size);
+#pragma omp parallel if (batch_size > 1)
+  {
+    std::vector<T> work(n_scores);
+#pragma omp for
+    for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+      long itarget = target->at({i_batch}) - 1; // 1based->0based
+      const T* input_data = input->data() + i_batch * input_size;
+      T* score_data = score->data() + i_batch * n_scores;
+      score_data[0] = blas::dot(input_size, input_data, 1,
+                                weight->data() + itarget * weight->stride(0),
+                                weight->stride(1)) +
+        bias->at({itarget}) - log_n_samples - log_prob->at({itarget});
+      for (long j = 0; j < n_samples; ++j) {
+        if (sample_ids->at({j}) - 1 == itarget)
+          score_data[j + 1] = -std::numeric_limits<T>::infinity();
+        else
+          score_data[j + 1] += sample_shift[j];
+      }
+      T loss;
+      if (nce) {
+        loss = softPlus(-score_data[0]);
+        for (long j = 1; j < n_scores; ++j)
+          loss += softPlus(score_data[j]);
+      } else {
+        T logsum_local = vml::logSumExp(n_scores, score_data, work.data());
+        logsum->at({i_batch}) = logsum_local;
+        loss = logsum_local - score_data[0];
+      }
+      sample_output[i_batch] = loss;
+    }
+  }
+  T output = 0.;
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch)
+    output += sample_output[i_batch];
+  lua_pushnumber(L, output);
+  return 1;
+}
+
+// Turns `score` into the gradient wrt the logits, and computes gradInput.
+template <class T>
+int updateGradInput(lua_State* L) {
+  auto gradInput     = luaGetFieldIfTensorChecked<T>(L, 1, "gradInput");
+  auto weight        = luaGetFieldIfTensorChecked<T>(L, 1, "weight");
+  auto score         = luaGetFieldIfTensorChecked<T>(L, 1, "score");
+  auto logsum        = luaGetFieldIfTensorChecked<T>(L, 1, "logsum");
+  auto sample_weight = luaGetFieldIfTensorChecked<T>(L, 1, "sample_weight");
+  bool nce = luaGetFieldIfBoolean(L, 1, "nce").value_or(false);
+  auto target = luaGetTensorChecked<long>(L, 2);
+  luaL_argcheck(L, gradInput->isContiguous(), 1,
+                "gradInput must be contiguous");
+  long input_size = weight->size(1);
+  long batch_size = score->size(0);
+  long n_scores = score->size(1);
+
+#pragma omp parallel for if (batch_size > 1)
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+    T* score_data = score->data() + i_batch * n_scores;
+    if (nce) {
+      score_data[0] = sigmoid(score_data[0]) - 1.;
+      for (long j = 1; j < n_scores; ++j)
+        score_data[j] = sigmoid(score_data[j]);
+    } else {
+      vml::expShifted(n_scores, score_data, logsum->at({i_batch}),
+                      score_data);
+      score_data[0] -= 1.;
+    }
+  }
+  //   sampled classes, for the whole batch
+  blas::gemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+             batch_size, input_size, n_scores - 1,
+             1, score->data() + 1, n_scores,
+             sample_weight->data(), input_size,
+             0, gradInput->data(), input_size);
+  //   targets
+#pragma omp parallel for if (batch_size > 1)
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+    long itarget = target->at({i_batch}) - 1; // 1based->0based
+    blas::axpy(input_size, score->at({i_batch, 0}),
+               weight->data() + itarget * weight->stride(0),
+               weight->stride(1), gradInput->data() + i_batch * input_size, 1);
+  }
+  return 0;
+}
+
+// Accumulates scale * gradients into the rows of `grad_weight` and
+// `grad_bias` of the targets and sampled classes, and records them as
+// touched (or, with direct_update, adds them to `weight` and `bias`).
+template <class T>
+int accGradParameters(lua_State* L) {
+  auto score      = luaGetFieldIfTensorChecked<T>(L, 1, "score");
+  auto sample_ids = luaGetFieldIfTensorChecked<long>(L, 1, "sample_ids");
+  auto input  = luaGetTensorChecked<T>(L, 2);
+  auto target = luaGetTensorChecked<long>(L, 3);
+  T scale = luaGetNumberChecked<T>(L, 4);
+  bool direct_update = luaGetBoolean(L, 5).value_or(false);
+  auto grad_weight = luaGetFieldIfTensorChecked<T>(
+    L, 1, direct_update ? "weight" : "grad_weight");
+  auto grad_bias = luaGetFieldIfTensorChecked<T>(
+    L, 1, direct_update ? "bias" : "grad_bias");
+  luaL_argcheck(L, input->isContiguous(), 2, "input must be contiguous");
+  long input_size = grad_weight->size(1);
+  long batch_size = score->size(0);
+  long n_scores = score->size(1);
+  long n_samples = n_scores - 1;
+
+  //   sampled classes: one GEMM for the whole batch, then added row by row
+  //   (a class can be sampled several times)
+  std::vector<T> sample_grad(n_samples * input_size);
+  blas::gemm(CblasRowMajor, CblasTrans, CblasNoTrans,
+             n_samples, input_size, batch_size,
+             scale, score->data() + 1, n_scores,
+             input->data(), input_size,
+             0, sample_grad.data(), input_size);
+  for (long j = 0; j < n_samples; ++j) {
+    long id = sample_ids->at({j}) - 1; // 1based->0based
+    blas::axpy(input_size, 1, sample_grad.data() + j * input_size, 1,
+               grad_weight->data() + id * grad_weight->stride(0),
+               grad_weight->stride(1));
+    T bias_grad = 0.;
+    for (long i_batch = 0; i_batch < batch_size; ++i_batch)
+      bias_grad += score->at({i_batch, j + 1});
+    grad_bias->at({id}) += scale * bias_grad;
+  }
+  //   targets, in batch order
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+    long itarget = target->at({i_batch}) - 1; // 1based->0based
+    T g = scale * score->at({i_batch, 0});
+    blas::axpy(input_size, g, input->data() + i_batch * input_size, 1,
+               grad_weight->data() + itarget * grad_weight->stride(0),
+               grad_weight->stride(1));
+    grad_bias->at({itarget}) += g;
+  }
+  if (direct_update)
+    return 0;
+  auto touched_rows = luaGetFieldIfTensorChecked<long>(L, 1, "touched_rows");
+  auto row_touched =
+    luaGetFieldIfTensorChecked<unsigned char>(L, 1, "row_touched");
+  auto n_touched = luaGetFieldIfTensorChecked<long>(L, 1, "n_touched");
+  for (long j = 0; j < n_samples; ++j)
+    touchRow(*touched_rows, *row_touched, *n_touched, sample_ids->at({j}));
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch)
+    touchRow(*touched_rows, *row_touched, *n_touched, target->at({i_batch}));
+  return 0;
+}
+
+// Zeroes the touched rows of the gradients, and forgets them.
+template <class T>
+int zeroGradParameters(lua_State* L) {
+  auto grad_weight  = luaGetFieldIfTensorChecked<T>(L, 1, "grad_weight");
+  auto grad_bias    = luaGetFieldIfTensorChecked<T>(L, 1, "grad_bias");
+  auto touched_rows = luaGetFieldIfTensorChecked<long>(L, 1, "touched_rows");
+  auto row_touched =
+    luaGetFieldIfTensorChecked<unsigned char>(L, 1, "row_touched");
+  auto n_touched = luaGetFieldIfTensorChecked<long>(L, 1, "n_touched");
+  long input_size = grad_weight->size(1);
+  for (long i = 0; i < n_touched->at({0}); ++i) {
+    long row = touched_rows->at({i}) - 1; // 1based->0based
+    T* grad_data = grad_weight->data() + row * grad_weight->stride(0);
+    for (long d = 0; d < input_size; ++d)
+      grad_data[d * grad_weight->stride(1)] = 0.;
+    grad_bias->at({row}) = 0.;
+    row_touched->at({row}) = 0;
+  }
+  n_touched->fill(0);
+  return 0;
+}
+
+// Parameters -= learning_rate * gradients, for the touched rows only.
+template <class T>
+int updateParameters(lua_State* L) {
+  auto weight       = luaGetFieldIfTensorChecked<T>(L, 1, "weight");
+  auto bias         = luaGetFieldIfTensorChecked<T>(L, 1, "bias");
+  auto grad_weight  = luaGetFieldIfTensorChecked<T>(L, 1, "grad_weight");
+  auto grad_bias    = luaGetFieldIfTensorChecked<T>(L, 1, "grad_bias");
+  auto touched_rows = luaGetFieldIfTensorChecked<long>(L, 1, "touched_rows");
+  auto n_touched = luaGetFieldIfTensorChecked<long>(L, 1, "n_touched");
+  T learning_rate = luaGetNumberChecked<T>(L, 2);
+  long input_size = weight->size(1);
+  long n_rows = n_touched->at({0});
+#pragma omp parallel for if (n_rows * input_size > 100000)
+  for (long i = 0; i < n_rows; ++i) {
+    long row = touched_rows->at({i}) - 1; // 1based->0based
+    blas::axpy(input_size, -learning_rate,
+               grad_weight->data() + row * grad_weight->stride(0),
+               grad_weight->stride(1),
+               weight->data() + row * weight->stride(0), weight->stride(1));
+    bias->at({row}) -= learning_rate * grad_bias->at({row});
+  }
+  return 0;
+}
+
+template <class T>
+class Registerer {
+ private:
+  static const luaL_Reg functions_[];
+public:
+  static void registerFunctions(lua_State* L);
+};
+
+template <class T>
+const luaL_Reg Registerer<T>::functions_[] = {
+  {"SampledSoftMax_updateOutput"       , updateOutput<T>},
+  {"SampledSoftMax_updateGradInput"    , updateGradInput<T>},
+  {"SampledSoftMax_accGradParameters"  , accGradParameters<T>},
+  {"SampledSoftMax_zeroGradParameters" , zeroGradParameters<T>},
+  {"SampledSoftMax_updateParameters"   , updateParameters<T>},
+  {nullptr, nullptr},
+};
+
+template <class T>
+void Registerer<T>::registerFunctions(lua_State* L) {
+  luaT_pushmetatable(L, Tensor<T>::kLuaTypeName);
+  luaT_registeratname(L, functions_, "nn");
+  lua_pop(L, 1);
+}
+
+} // namespace
+
+void initSampledSoftMax(lua_State* L) {
+  Registerer<float>::registerFunctions(L);
+  Registerer<double>::registerFunctions(L);
+}
+
+}}} // namespaces
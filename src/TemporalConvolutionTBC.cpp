@@ -10,8 +10,15 @@
 #include <luaT.h>
 #include <mkl.h>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
 #include "Blas.h"
 #include "Vml.h"
 #include "fblualib/LuaUtils.h"
@@ -30,119 +37,960 @@ namespace {
 template <class T>
 using thOps = thpp::detail::TensorOps<T>;
 
+// The kw products of a pass are either done by kw gemm calls on shifted
+// slices of the input (beta = 1), or by a single gemm on the time-unfolded
+// input, which holds kw * inputPlanes values per output frame and batch
+// element. The latter avoids thin gemm calls when there are few planes, at
+// the cost of a kw times larger copy of the input; which one is faster
+// depends on the BLAS library and the machine. Setting the `unfold` field
+// to true or false forces a strategy; by default, the first forward pass
+// of each shape times both and the faster one is then used for all passes.
+enum class Strategy { kShifted, kUnfolded, kTune };
+
+// Largest unfolded input (in elements)
+const long kUnfoldMaxSize = 1L << 26;
+
+// Shape: element size, kw, stride, dilation, input planes, output planes
+// and log2 of the number of rows
+typedef std::tuple<size_t, long, long, long, long, long, int> Shape;
+std::mutex tunedMutex;
+std::map<Shape, bool> tunedUnfold;
+
+// Whether the frames of t are evenly spaced by the batch stride, so that
+// all its rows can be handled by a single gemm
+template <class T>
+bool rowsEvenlySpaced(const Tensor<T>& t) {
+  return t.stride(0) == t.size(1) * t.stride(1);
+}
+
+// Geometry of the convolution: output frame t reads the input frames
+// t * stride - pad + k * dilation, for k = 0 .. kw - 1.
+// With the optional `input_lengths` field (one length per batch element),
+// the frames past the length of a sequence are padding: they are not read,
+// and the convolution is set to zero without being computed on the output
+// frames past its output length (before the epilogue), so that each
+// sequence is convolved as if it were alone. The gradients ignore these
+// frames.
+struct Geometry {
+  long kw;
+  long pad;
+  long stride;
+  long dilation;
+  // empty without input_lengths
+  std::vector<long> inputLengths;
+  std::vector<long> outputLengths;
+};
+
+// Reads the stride and dilation fields (1 by default), the pad field
+// (deduced from the lengths if absent, as stride 1 is then assumed) and
+// the input_lengths field, unless `readLengths` is false
+Geometry geometryOf(
+    lua_State* L,
+    long kw,
+    long ilen,
+    long olen,
+    long batchSize,
+    bool readLengths = true) {
+  Geometry g;
+  g.kw = kw;
+  g.stride = luaGetFieldIfNumber<long>(L, 1, "stride").value_or(1);
+  g.dilation = luaGetFieldIfNumber<long>(L, 1, "dilation").value_or(1);
+  luaL_argcheck(
+      L, g.stride >= 1 && g.dilation >= 1, 1, "invalid stride or dilation");
+  g.pad = luaGetFieldIfNumber<long>(L, 1, "pad").value_or(
+      (olen - ilen + (kw - 1) * g.dilation) / 2);
+
+  if (!readLengths) {
+    return g;
+  }
+  auto lengths = luaGetFieldIfTensor<long>(L, 1, "input_lengths");
+  if (lengths && (*lengths)->size() > 0) {
+    const Tensor<long>& l = **lengths;
+    luaL_argcheck(
+        L,
+        l.ndims() == 1 && l.size(0) == batchSize,
+        1,
+        "input_lengths needs one length per batch element");
+    for (long b = 0; b < batchSize; b++) {
+      long length = l.at({b});
+      luaL_argcheck(
+          L, length >= 0 && length <= ilen, 1, "input length out of range");
+      long span = length + 2 * g.pad - (kw - 1) * g.dilation;
+      g.inputLengths.push_back(length);
+      g.outputLengths.push_back(
+          span >= 1 ? std::min(olen, (span - 1) / g.stride + 1) : 0);
+    }
+  }
+  return g;
+}
+
+// Number of output frames of batch element b
+inline long outputLength(const Geometry& g, long b, long olen) {
+  return g.outputLengths.empty() ? olen : g.outputLengths[b];
+}
+
+// Calls f(output offset, input offset, rows, output ld, input ld) for the
+// blocks of evenly spaced rows that tap k connects. With stride 1 this is a
+// single block; otherwise the rows are grouped by frame or by batch
+// element, whichever gives fewer blocks. With input lengths, these blocks
+// cover the frames that all sequences have, and the frames past them get
+// one block per longer sequence.
+template <class T, class F>
+void forEachTapBlock(
+    const Geometry& g,
+    long k,
+    const Tensor<T>& input,
+    const Tensor<T>& output,
+    F f) {
+  long olen = output.size(0);
+  long batchSize = output.size(1);
+  // input frame of output frame 0
+  long offset = k * g.dilation - g.pad;
+  long begin = offset >= 0 ? 0 : (g.stride - 1 - offset) / g.stride;
+  // end of the output frames of a sequence that read its input
+  auto endOf = [&](long ilen, long olen) {
+    return offset >= ilen
+        ? 0
+        : std::min(olen, (ilen - 1 - offset) / g.stride + 1);
+  };
+  long end = endOf(input.size(0), olen);
+  if (!g.inputLengths.empty()) {
+    long common = end;
+    for (long b = 0; b < batchSize; b++) {
+      common = std::min(
+          common, endOf(g.inputLengths[b], g.outputLengths[b]));
+    }
+    for (long b = 0; b < batchSize; b++) {
+      long tailBegin = std::max(begin, common);
+      long tailEnd = endOf(g.inputLengths[b], g.outputLengths[b]);
+      if (tailBegin < tailEnd) {
+        f(tailBegin * output.stride(0) + b * output.stride(1),
+          (tailBegin * g.stride + offset) * input.stride(0) +
+              b * input.stride(1),
+          tailEnd - tailBegin,
+          output.stride(0),
+          g.stride * input.stride(0));
+      }
+    }
+    end = common;
+  }
+  if (begin >= end) {
+    return;
+  }
+  long first = begin * g.stride + offset;
+  if (g.stride == 1) {
+    f(begin * output.stride(0),
+      first * input.stride(0),
+      (end - begin) * batchSize,
+      output.stride(1),
+      input.stride(1));
+  } else if (batchSize >= end - begin) {
+    for (long t = begin; t < end; t++) {
+      f(t * output.stride(0),
+        (first + (t - begin) * g.stride) * input.stride(0),
+        batchSize,
+        output.stride(1),
+        input.stride(1));
+    }
+  } else {
+    for (long b = 0; b < batchSize; b++) {
+      f(begin * output.stride(0) + b * output.stride(1),
+        first * input.stride(0) + b * input.stride(1),
+        end - begin,
+        output.stride(0),
+        g.stride * input.stride(0));
+    }
+  }
+}
+
+template <class T>
+Shape shapeOf(
+    const Geometry& g,
+    const Tensor<T>& weight,
+    const Tensor<T>& output) {
+  long rows = output.size(0) * output.size(1);
+  int log_rows = 0;
+  while ((2L << log_rows) <= rows) {
+    ++log_rows;
+  }
+  return Shape(
+      sizeof(T), g.kw, g.stride, g.dilation, weight.size(1), weight.size(2),
+      log_rows);
+}
+
+// Picks the strategy for a pass; output is the output (or its gradient)
+template <class T>
+Strategy strategy(
+    lua_State* L,
+    const Geometry& g,
+    const Tensor<T>& weight,
+    const Tensor<T>& output) {
+  auto unfolded = luaGetFieldIfTensor<T>(L, 1, "unfolded");
+  // the unfolded input would hold the padding frames
+  if (!unfolded || !weight.isContiguous() || !rowsEvenlySpaced(output) ||
+      !g.inputLengths.empty()) {
+    return Strategy::kShifted;
+  }
+  auto unfold = luaGetFieldIfBoolean(L, 1, "unfold");
+  if (unfold) {
+    return *unfold ? Strategy::kUnfolded : Strategy::kShifted;
+  }
+  long rows = output.size(0) * output.size(1);
+  if (weight.size(0) == 1 ||
+      rows * weight.size(0) * weight.size(1) > kUnfoldMaxSize) {
+    return Strategy::kShifted;
+  }
+  std::lock_guard<std::mutex> lock(tunedMutex);
+  auto it = tunedUnfold.find(shapeOf(g, weight, output));
+  if (it == tunedUnfold.end()) {
+    return Strategy::kTune;
+  }
+  return it->second ? Strategy::kUnfolded : Strategy::kShifted;
+}
+
+#if defined(INTEL_MKL_VERSION) && INTEL_MKL_VERSION >= 20170000
+#define TBC_PACKED_GEMM
+#endif
+
+#ifdef TBC_PACKED_GEMM
+// 64-bit hash of the bit patterns of all the entries of the (contiguous)
+// weight: one linear read, in kLanes independent FNV-1a chains so that it
+// runs at memory speed, cheap next to the gemm.
+template <class T>
+long weightChecksum(const Tensor<T>& weight) {
+  constexpr long kLanes = 8;
+  constexpr uint64_t kPrime = 1099511628211ULL;
+  long n = weight.size();
+  const T* data = weight.data();
+  uint64_t lanes[kLanes];
+  std::fill(lanes, lanes + kLanes, 14695981039346656037ULL);
+  long i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    for (long l = 0; l < kLanes; l++) {
+      uint64_t bits = 0;
+      std::memcpy(&bits, data + i + l, sizeof(T));
+      lanes[l] = (lanes[l] ^ bits) * kPrime;
+    }
+  }
+  for (; i < n; i++) {
+    uint64_t bits = 0;
+    std::memcpy(&bits, data + i, sizeof(T));
+    lanes[0] = (lanes[0] ^ bits) * kPrime;
+  }
+  uint64_t hash = static_cast<uint64_t>(n);
+  for (long l = 0; l < kLanes; l++) {
+    hash = (hash ^ lanes[l]) * kPrime;
+  }
+  return static_cast<long>(hash);
+}
+
+// At inference (the module's `train` is false), the weight matrix of each
+// tap is packed once into MKL's gemm format, so that the forward gemm
+// calls do not pack it again. The packed taps are kept in `packed_weight`,
+// and `packed_key` identifies the weight they come from (address, sizes
+// and a hash of all its entries), so that replacing the weight or
+// changing any of its entries in place repacks it. Returns null if the
+// weight is not packed.
+template <class T>
+const T* packedWeight(lua_State* L, const Tensor<T>& weight, long* tapSize) {
+  auto packed = luaGetFieldIfTensor<T>(L, 1, "packed_weight");
+  auto key = luaGetFieldIfTensor<long>(L, 1, "packed_key");
+  if (luaGetFieldIfBoolean(L, 1, "train").value_or(true) || !packed ||
+      !key || !weight.isContiguous()) {
+    return nullptr;
+  }
+  long kw = weight.size(0);
+  long inputPlanes = weight.size(1);
+  long outputPlanes = weight.size(2);
+  // the packed A matrix does not depend on the number of columns of B
+  size_t bytes = blas::gemm_pack_get_size<T>(
+      CblasAMatrix, outputPlanes, 1, inputPlanes);
+  *tapSize = (bytes + sizeof(T) - 1) / sizeof(T);
+
+  long current[] = {reinterpret_cast<long>(weight.data()), kw, inputPlanes,
+                    outputPlanes, weightChecksum(weight)};
+  auto& previous = **key;
+  if (previous.ndims() != 1 || previous.size(0) != 5 ||
+      !std::equal(current, current + 5, previous.data())) {
+    (*packed)->resize(LongStorage{kw, *tapSize});
+    for (long k = 0; k < kw; k++) {
+      blas::gemm_pack(
+          CblasColMajor,
+          CblasAMatrix,
+          CblasNoTrans,
+          outputPlanes, // r
+          1,
+          inputPlanes, // m
+          T(1),
+          weight.data() + k * weight.stride(0),
+          outputPlanes,
+          (*packed)->data() + k * *tapSize);
+    }
+    previous.resize(LongStorage{5});
+    std::copy(current, current + 5, previous.data());
+  }
+  return (*packed)->data();
+}
+#endif
+
+// Writes the time-unfolded input: row t * batchSize + b holds the kw input
+// frames read by output frame t of batch element b (zeros out of range)
+template <class T>
+void unfoldInput(
+    const Tensor<T>& input,
+    Tensor<T>& unfolded,
+    long olen,
+    const Geometry& g) {
+  long kw = g.kw;
+  long ilen = input.size(0);
+  long batchSize = input.size(1);
+  long inputPlanes = input.size(2);
+  long width = kw * inputPlanes;
+  unfolded.resize(LongStorage{olen * batchSize, width});
+  auto I = input.data();
+  auto U = unfolded.data();
+
+  #pragma omp parallel for if (olen * batchSize * width > 100000)
+  for (long row = 0; row < olen * batchSize; row++) {
+    long t = row / batchSize;
+    long b = row % batchSize;
+    for (long k = 0; k < kw; k++) {
+      long it = t * g.stride - g.pad + k * g.dilation;
+      T* dst = U + row * width + k * inputPlanes;
+      if (it < 0 || it >= ilen) {
+        std::fill(dst, dst + inputPlanes, T(0));
+      } else {
+        const T* src = I + it * input.stride(0) + b * input.stride(1);
+        std::copy(src, src + inputPlanes, dst);
+      }
+    }
+  }
+}
+
+// Adds the unfolded gradient back to the input frames it was read from
+template <class T>
+void foldGradInput(
+    const Tensor<T>& unfolded,
+    Tensor<T>& dInput,
+    long olen,
+    const Geometry& g) {
+  long kw = g.kw;
+  long ilen = dInput.size(0);
+  long batchSize = dInput.size(1);
+  long inputPlanes = dInput.size(2);
+  long width = kw * inputPlanes;
+  auto dU = unfolded.data();
+  auto dI = dInput.data();
+
+  #pragma omp parallel for if (ilen * batchSize * width > 100000)
+  for (long row = 0; row < ilen * batchSize; row++) {
+    long it = row / batchSize;
+    long b = row % batchSize;
+    T* dst = dI + it * dInput.stride(0) + b * dInput.stride(1);
+    for (long k = 0; k < kw; k++) {
+      long shifted = it + g.pad - k * g.dilation;
+      long t = shifted / g.stride;
+      if (shifted < 0 || shifted % g.stride != 0 || t >= olen) {
+        continue;
+      }
+      const T* src = dU + (t * batchSize + b) * width + k * inputPlanes;
+      #pragma omp simd
+      for (long i = 0; i < inputPlanes; i++) {
+        dst[i] += src[i];
+      }
+    }
+  }
+}
+
+// Computes output from input (sizes are checked by the caller), through
+// the unfolded input if given, else with the packed weight taps (tapSize
+// elements each) if given
+template <class T>
+void convolve(
+    const Tensor<T>& weight,
+    const Tensor<T>& bias,
+    const Tensor<T>& input,
+    Tensor<T>& output,
+    const Geometry& g,
+    Tensor<T>* unfolded,
+    const T* packed = nullptr,
+    long tapSize = 0) {
+  auto batchSize = input.size(1);
+  auto inputPlanes = input.size(2);
+  auto outputPlanes = output.size(2);
+  auto olen = output.size(0);
+  auto kw = weight.size(0);
+  auto W = weight.data();
+  auto B = bias.data();
+  auto I = input.data();
+  auto O = output.data();
+
+  for (long t = 0; t < olen; t++) {
+    for (long b = 0; b < batchSize; b++) {
+      T* row = O + t * output.stride(0) + b * output.stride(1);
+      if (t < outputLength(g, b, olen)) {
+        std::copy(B, B + outputPlanes, row);
+      } else {
+        std::fill(row, row + outputPlanes, T(0));
+      }
+    }
+  }
+  if (unfolded) {
+    unfoldInput(input, *unfolded, olen, g);
+    // unfolded input is l*m (row-major), weight is m*r (row-major)
+    blas::gemm(
+        CblasColMajor,
+        CblasNoTrans,
+        CblasNoTrans,
+        outputPlanes, // r
+        olen * batchSize, // l
+        kw * inputPlanes, // m
+        1, // alpha
+        W,
+        outputPlanes,
+        unfolded->data(),
+        kw * inputPlanes,
+        1, // beta
+        O,
+        output.stride(1)
+        );
+    return;
+  }
+  for (int k = 0; k < kw; k++) {
+    // Note: using gemm in column-major order mode
+    // input    is l*m (row-major)
+    // weight   is m*r (row-major)
+    // output   is l*r (row-major)
+    forEachTapBlock(g, k, input, output,
+                    [&](long oOff, long iOff, long l, long ldo, long ldi) {
+#ifdef TBC_PACKED_GEMM
+      if (packed) {
+        blas::gemm_compute(
+            CblasColMajor,
+            CblasPacked,
+            CblasNoTrans,
+            outputPlanes, // r
+            l, // l
+            inputPlanes, // m
+            packed + k * tapSize,
+            outputPlanes,
+            I + iOff,
+            ldi,
+            1, // beta
+            O + oOff,
+            ldo);
+        return;
+      }
+#endif
+      blas::gemm(
+          CblasColMajor,
+          CblasNoTrans,
+          CblasNoTrans,
+          outputPlanes, // r
+          l, // l
+          inputPlanes, // m
+          1, // alpha
+          W + k * weight.stride(0),
+          outputPlanes,
+          I + iOff,
+          ldi,
+          1, // beta
+          O + oOff,
+          ldo
+          );
+    });
+  }
+}
+
+// Int8 inference (see TBC:quantize): the weight of convolution plane o is
+// stored as int8 values times weight_scales[o], in `quantized_weight`, a
+// ByteTensor of planes x (kw * nIn) bytes. The input is quantized with a
+// single scale into `quantized_input`: input_scale if the module was
+// calibrated, else max |input| / 127, measured at each forward. The products
+// are accumulated in int32, and the scales and the bias are applied to the
+// sums.
+typedef Tensor<unsigned char> Int8Tensor;
+
+inline int8_t quantizeValue(double x, double invScale) {
+  double q = std::nearbyint(x * invScale);
+  return static_cast<int8_t>(std::max(-127.0, std::min(127.0, q)));
+}
+
+inline int8_t* int8Data(Int8Tensor& t) {
+  return reinterpret_cast<int8_t*>(t.data());
+}
+
+// Forward pass with the int8 weight, in evaluation mode. Returns false if
+// the weight is not quantized or in training mode.
+template <class T>
+bool quantizedForward(
+    lua_State* L,
+    const Tensor<T>& bias,
+    const Tensor<T>& input,
+    Tensor<T>& output,
+    const Geometry& g) {
+  auto qWeight = luaGetFieldIfTensor<unsigned char>(L, 1, "quantized_weight");
+  if (luaGetFieldIfBoolean(L, 1, "train").value_or(true) || !qWeight ||
+      (*qWeight)->size() == 0) {
+    return false;
+  }
+  auto scales = luaGetFieldIfTensorChecked<T>(L, 1, "weight_scales");
+  auto qInput = luaGetFieldIfTensorChecked<unsigned char>(
+      L, 1, "quantized_input");
+  long kw = g.kw;
+  long ilen = input.size(0);
+  long batchSize = input.size(1);
+  long inputPlanes = input.size(2);
+  long olen = output.size(0);
+  long outputPlanes = output.size(2);
+  long width = kw * inputPlanes;
+  luaL_argcheck(
+      L,
+      (*qWeight)->ndims() == 2 && (*qWeight)->isContiguous() &&
+          (*qWeight)->size(0) == outputPlanes &&
+          (*qWeight)->size(1) == width && scales->size() == outputPlanes,
+      1,
+      "quantized weight has wrong dimension (call quantize again)");
+
+  double inputScale =
+      luaGetFieldIfNumber<double>(L, 1, "input_scale").value_or(0);
+  if (inputScale <= 0) {
+    T maxAbs = 0;
+    #pragma omp parallel for reduction(max : maxAbs)
+    for (long t = 0; t < ilen; t++) {
+      for (long b = 0; b < batchSize; b++) {
+        const T* row = input.data() + t * input.stride(0) +
+            b * input.stride(1);
+        for (long i = 0; i < inputPlanes; i++) {
+          maxAbs = std::max(maxAbs, std::abs(row[i]));
+        }
+      }
+    }
+    inputScale = maxAbs > 0 ? maxAbs / 127.0 : 1.0;
+  }
+  qInput->resize(LongStorage{ilen, batchSize, inputPlanes});
+  int8_t* qI = int8Data(*qInput);
+  double invScale = 1 / inputScale;
+  #pragma omp parallel for
+  for (long t = 0; t < ilen; t++) {
+    for (long b = 0; b < batchSize; b++) {
+      const T* row = input.data() + t * input.stride(0) + b * input.stride(1);
+      int8_t* q = qI + (t * batchSize + b) * inputPlanes;
+      for (long i = 0; i < inputPlanes; i++) {
+        q[i] = quantizeValue(row[i], invScale);
+      }
+    }
+  }
+
+  const int8_t* qW = int8Data(**qWeight);
+  const T* S = scales->data();
+  const T* B = bias.data();
+  #pragma omp parallel for collapse(2)
+  for (long t = 0; t < olen; t++) {
+    for (long b = 0; b < batchSize; b++) {
+      T* out = output.data() + t * output.stride(0) + b * output.stride(1);
+      if (t >= outputLength(g, b, olen)) {
+        std::fill(out, out + outputPlanes, T(0));
+        continue;
+      }
+      long length = g.inputLengths.empty() ? ilen : g.inputLengths[b];
+      for (long o = 0; o < outputPlanes; o++) {
+        int32_t acc = 0;
+        for (long k = 0; k < kw; k++) {
+          long frame = t * g.stride - g.pad + k * g.dilation;
+          if (frame < 0 || frame >= length) {
+            continue;
+          }
+          const int8_t* x = qI + (frame * batchSize + b) * inputPlanes;
+          const int8_t* w = qW + o * width + k * inputPlanes;
+          #pragma omp simd reduction(+ : acc)
+          for (long i = 0; i < inputPlanes; i++) {
+            acc += int32_t(x[i]) * int32_t(w[i]);
+          }
+        }
+        out[o] = B[o] + T(acc * (inputScale * S[o]));
+      }
+    }
+  }
+  return true;
+}
+
+// Forward pass with the strategy of the shape, timing both strategies if
+// it is not known yet
+template <class T>
+void forward(
+    lua_State* L,
+    const Tensor<T>& weight,
+    const Tensor<T>& bias,
+    const Tensor<T>& input,
+    Tensor<T>& output,
+    const Geometry& g) {
+  if (quantizedForward(L, bias, input, output, g)) {
+    return;
+  }
+#ifdef TBC_PACKED_GEMM
+  long tapSize;
+  if (auto packed = packedWeight(L, weight, &tapSize)) {
+    convolve(weight, bias, input, output, g,
+             static_cast<Tensor<T>*>(nullptr), packed, tapSize);
+    return;
+  }
+#endif
+  auto mode = strategy(L, g, weight, output);
+  auto unfolded = luaGetFieldIfTensor<T>(L, 1, "unfolded");
+  if (mode != Strategy::kTune) {
+    convolve(weight, bias, input, output, g,
+             mode == Strategy::kUnfolded ? unfolded->get() : nullptr);
+    return;
+  }
+  typedef std::chrono::steady_clock Clock;
+  Clock::duration shifted, unfold;
+  // the first round warms up the caches and the unfolded buffer
+  for (int round = 0; round < 2; round++) {
+    auto start = Clock::now();
+    convolve(weight, bias, input, output, g, unfolded->get());
+    auto middle = Clock::now();
+    convolve(
+        weight, bias, input, output, g, static_cast<Tensor<T>*>(nullptr));
+    shifted = Clock::now() - middle;
+    unfold = middle - start;
+  }
+  std::lock_guard<std::mutex> lock(tunedMutex);
+  tunedUnfold[shapeOf(g, weight, output)] = unfold < shifted;
+}
+
+// Optional epilogue of the forward pass: output = activation(conv), plus the
+// input frames with `residual` (which needs as many input as output planes
+// and frames). GLU halves the planes: first half * sigmoid(second half).
+// The epilogue runs over the convolution output once, instead of once per
+// module; ReLU without residual is applied in place, and otherwise the
+// convolution is kept in `preactivation` for the backward pass.
+enum Activation { kNone = 0, kReLU = 1, kGLU = 2 };
+
+bool keepsPreactivation(Activation activation, bool residual) {
+  return activation == kGLU || (activation == kReLU && residual);
+}
+
+template <class T>
+void epilogue(
+    Activation activation,
+    const Tensor<T>& conv,
+    Tensor<T>& output,
+    const Tensor<T>* residual) {
+  if (activation == kNone && !residual) {
+    return;
+  }
+  long batchSize = output.size(1);
+  long rows = output.size(0) * batchSize;
+  long planes = output.size(2);
+  long convPlanes = conv.size(2);
+  auto C = conv.data();
+  auto O = output.data();
+
+  #pragma omp parallel for if (rows * convPlanes > 100000)
+  for (long row = 0; row < rows; row++) {
+    const T* c = C + row * convPlanes;
+    T* o = O + row * planes;
+    if (activation == kReLU) {
+      #pragma omp simd
+      for (long i = 0; i < planes; i++) {
+        o[i] = std::max(c[i], T(0));
+      }
+    } else if (activation == kGLU) {
+      for (long i = 0; i < planes; i++) {
+        o[i] = c[i] / (1 + std::exp(-c[planes + i]));
+      }
+    }
+    if (residual) {
+      const T* r = residual->data() + (row / batchSize) * residual->stride(0) +
+          (row % batchSize) * residual->stride(1);
+      #pragma omp simd
+      for (long i = 0; i < planes; i++) {
+        o[i] += r[i];
+      }
+    }
+  }
+}
+
+// Gradient wrt the convolution output, from the gradient wrt the output and
+// the input of the activation (for ReLU, its output does as well)
+template <class T>
+void activationGrad(
+    Activation activation,
+    const Tensor<T>& conv,
+    const Tensor<T>& dOutput,
+    Tensor<T>& dConv) {
+  long batchSize = dOutput.size(1);
+  long rows = dOutput.size(0) * batchSize;
+  long planes = dOutput.size(2);
+  long convPlanes = conv.size(2);
+  dConv.resize(LongStorage{dOutput.size(0), batchSize, convPlanes});
+  auto C = conv.data();
+  auto dC = dConv.data();
+
+  #pragma omp parallel for if (rows * convPlanes > 100000)
+  for (long row = 0; row < rows; row++) {
+    const T* c = C + row * convPlanes;
+    const T* g = dOutput.data() + (row / batchSize) * dOutput.stride(0) +
+        (row % batchSize) * dOutput.stride(1);
+    T* dc = dC + row * convPlanes;
+    if (activation == kReLU) {
+      #pragma omp simd
+      for (long i = 0; i < planes; i++) {
+        dc[i] = c[i] > 0 ? g[i] : T(0);
+      }
+    } else {
+      for (long i = 0; i < planes; i++) {
+        T gate = 1 / (1 + std::exp(-c[planes + i]));
+        dc[i] = g[i] * gate;
+        dc[planes + i] = g[i] * c[i] * gate * (1 - gate);
+      }
+    }
+  }
+}
+
+// Reads the optional activation (argument index) and residual (index + 1)
+// arguments of the kernels
+Activation activationArg(lua_State* L, int index, bool* residual) {
+  int activation = luaGetNumber<int>(L, index).value_or(kNone);
+  luaL_argcheck(
+      L,
+      activation == kNone || activation == kReLU || activation == kGLU,
+      index,
+      "unknown activation");
+  *residual = luaGetBoolean(L, index + 1).value_or(false);
+  return static_cast<Activation>(activation);
+}
+
 template <class T>
 int updateOutput(lua_State* L) {
   auto output = luaGetFieldIfTensorChecked<T>(L, 1, "output");
   auto weight = luaGetFieldIfTensorChecked<T>(L, 1, "weight");
   auto bias = luaGetFieldIfTensorChecked<T>(L, 1, "bias");
   auto input = luaGetTensorChecked<T>(L, 2);
+  bool residual;
+  auto activation = activationArg(L, 3, &residual);
   auto ilen = input->size(0);
   auto batchSize = input->size(1);
   auto inputPlanes = input->size(2);
   auto outputPlanes = output->size(2);
+  auto convPlanes = activation == kGLU ? 2 * outputPlanes : outputPlanes;
   auto olen = output->size(0);
   auto kw = weight->size(0);
-  int pad = (olen - ilen + kw - 1) / 2;
+  auto g = geometryOf(L, kw, ilen, olen, batchSize);
+  long span = ilen + 2 * g.pad - (kw - 1) * g.dilation;
 
   luaL_argcheck(
       L,
       (output->ndims() == 3) && (output->size(1) == batchSize) &&
-          (olen == ilen - kw + 1 + 2 * pad),
+          (span >= 1) && (olen == (span - 1) / g.stride + 1),
       1,
       "output has wrong dimension");
   luaL_argcheck(L, (input->ndims() == 3), 2, "input has wrong dimension");
   luaL_argcheck(
       L,
       (weight->ndims() == 3) && (weight->size(1) == inputPlanes) &&
-          (weight->size(2) == outputPlanes),
+          (weight->size(2) == convPlanes),
       1,
       "weight has wrong dimension");
   luaL_argcheck(
       L,
-      (bias->ndims() == 1) && (bias->size(0) == outputPlanes),
+      (bias->ndims() == 1) && (bias->size(0) == convPlanes),
       1,
       "bias has wrong dimension");
+  luaL_argcheck(
+      L,
+      !residual ||
+          (inputPlanes == outputPlanes && ilen == olen && g.stride == 1),
+      4,
+      "residual needs the same input and output sizes");
 
-  auto W = weight->data();
-  auto B = bias->data();
-  auto I = input->data();
-  auto O = output->data();
+  auto conv = output;
+  if (keepsPreactivation(activation, residual)) {
+    conv = luaGetFieldIfTensorChecked<T>(L, 1, "preactivation");
+    conv->resize(LongStorage{olen, batchSize, convPlanes});
+  }
+  forward(L, *weight, *bias, *input, *conv, g);
+  epilogue(activation, *conv, *output, residual ? input.get() : nullptr);
+  return 0;
+}
 
-  for (int t = 0; t < olen; t++)
-    for (int b = 0; b < batchSize; b++)
-      for (int c = 0; c < outputPlanes; c++)
-        O[t * output->stride(0) + b * output->stride(1) + c] = B[c];
-  for (int k = 0; k < kw; k++) {
-    int iShift = std::max(0, k - pad);
-    int oShift = std::max(0, pad - k);
-    int t = std::min(ilen + pad - k, olen) - oShift;
-    // Note: using gemm in column-major order mode
-    // input    is l*m (row-major)
-    // weight   is m*r (row-major)
-    // output   is l*r (row-major)
-    if (t > 0)
-      blas::gemm(
-          CblasColMajor,
-          CblasNoTrans,
-          CblasNoTrans,
-          outputPlanes, // r
-          batchSize * t, // l
-          inputPlanes, // m
-          1, // alpha
-          W + k * weight->stride(0),
-          outputPlanes,
-          I + iShift * input->stride(0),
-          input->stride(1),
-          1, // beta
-          O + oShift * output->stride(0),
-          output->stride(1)
-          );
+// Incremental forward, for decoding one or a few frames at a time.
+// input holds the newest frames, and output gets the matching frames of the
+// causal convolution (the first frames of updateOutput with
+// pad = (kw - 1) * dilation, and stride 1). The (kw - 1) * dilation frames
+// that precede the input are kept in input_buffer, which is followed by the
+// new frames so that the same gemm calls apply; an empty (or resized)
+// buffer starts a new sequence.
+template <class T>
+int updateOutputIncremental(lua_State* L) {
+  auto output = luaGetFieldIfTensorChecked<T>(L, 1, "output");
+  auto weight = luaGetFieldIfTensorChecked<T>(L, 1, "weight");
+  auto bias = luaGetFieldIfTensorChecked<T>(L, 1, "bias");
+  auto buffer = luaGetFieldIfTensorChecked<T>(L, 1, "input_buffer");
+  auto input = luaGetTensorChecked<T>(L, 2);
+  bool residual;
+  auto activation = activationArg(L, 3, &residual);
+  auto ilen = input->size(0);
+  auto batchSize = input->size(1);
+  auto inputPlanes = input->size(2);
+  auto outputPlanes = output->size(2);
+  auto convPlanes = activation == kGLU ? 2 * outputPlanes : outputPlanes;
+  auto kw = weight->size(0);
+
+  luaL_argcheck(
+      L,
+      (input->ndims() == 3) && input->isContiguous(),
+      2,
+      "input has wrong dimension or is not contiguous");
+  luaL_argcheck(
+      L,
+      (output->ndims() == 3) && (output->size(0) == ilen) &&
+          (output->size(1) == batchSize),
+      1,
+      "output has wrong dimension");
+  luaL_argcheck(
+      L,
+      (weight->ndims() == 3) && (weight->size(1) == inputPlanes) &&
+          (weight->size(2) == convPlanes),
+      1,
+      "weight has wrong dimension");
+  luaL_argcheck(
+      L,
+      (bias->ndims() == 1) && (bias->size(0) == convPlanes),
+      1,
+      "bias has wrong dimension");
+  luaL_argcheck(
+      L,
+      !residual || inputPlanes == outputPlanes,
+      4,
+      "residual needs the same input and output sizes");
+
+  // the input lengths are those of whole sequences, not of the new frames
+  Geometry g = geometryOf(L, kw, ilen, ilen, batchSize, false);
+  luaL_argcheck(L, g.stride == 1, 1, "incremental forward needs stride 1");
+  g.pad = 0;
+  long frame = batchSize * inputPlanes;
+  long history = (kw - 1) * g.dilation;
+  bool resume = (buffer->ndims() == 3) && buffer->isContiguous() &&
+      (buffer->size(0) >= history) && (buffer->size(1) == batchSize) &&
+      (buffer->size(2) == inputPlanes);
+  if (resume) {
+    // keep the last frames at the front of the buffer
+    auto last = buffer->data() + (buffer->size(0) - history) * frame;
+    std::memmove(buffer->data(), last, history * frame * sizeof(T));
+    buffer->resize(LongStorage{history + ilen, batchSize, inputPlanes});
+  } else {
+    buffer->resize(LongStorage{history + ilen, batchSize, inputPlanes});
+    std::fill(buffer->data(), buffer->data() + history * frame, T(0));
+  }
+  std::copy(
+      input->data(), input->data() + ilen * frame,
+      buffer->data() + history * frame);
+
+  auto conv = output;
+  if (keepsPreactivation(activation, residual)) {
+    conv = luaGetFieldIfTensorChecked<T>(L, 1, "preactivation");
+    conv->resize(LongStorage{ilen, batchSize, convPlanes});
   }
+  forward(L, *weight, *bias, *buffer, *conv, g);
+  epilogue(activation, *conv, *output, residual ? input.get() : nullptr);
   return 0;
 }
+
+// With an activation, replaces dOutput by the gradient wrt the convolution
+// output, which is kept in `grad_preactivation`; it is only computed if
+// `ready` is false (else it is the one of the last updateGradInput).
+// The gradient of a residual connection is added by the caller.
+template <class T>
+void convGradOutput(
+    lua_State* L,
+    Activation activation,
+    bool residual,
+    bool ready,
+    typename Tensor<T>::Ptr& dOutput) {
+  if (activation == kNone) {
+    return;
+  }
+  auto dConv = luaGetFieldIfTensorChecked<T>(L, 1, "grad_preactivation");
+  if (!ready) {
+    auto conv = luaGetFieldIfTensorChecked<T>(
+        L, 1, keepsPreactivation(activation, residual) ? "preactivation"
+                                                       : "output");
+    activationGrad(activation, *conv, *dOutput, *dConv);
+  }
+  dOutput = dConv;
+}
+
 template <class T>
 int updateGradInput(lua_State* L) {
   auto dInput = luaGetFieldIfTensorChecked<T>(L, 1, "gradInput");
   auto weight = luaGetFieldIfTensorChecked<T>(L, 1, "weight");
   auto dOutput = luaGetTensorChecked<T>(L, 2);
+  bool residual;
+  auto activation = activationArg(L, 3, &residual);
+  convGradOutput<T>(L, activation, residual, false, dOutput);
   auto ilen = dInput->size(0);
   auto batchSize = dInput->size(1);
   auto inputPlanes = dInput->size(2);
   auto outputPlanes = dOutput->size(2);
   auto olen = dOutput->size(0);
   auto kw = weight->size(0);
-  int pad = (olen - ilen + kw - 1) / 2;
+  auto g = geometryOf(L, kw, ilen, olen, batchSize);
 
   auto W = weight->data();
   auto dI = dInput->data();
   auto dO = dOutput->data();
 
+  if (strategy(L, g, *weight, *dOutput) == Strategy::kUnfolded) {
+    auto unfolded = luaGetFieldIfTensorChecked<T>(L, 1, "unfolded");
+    // dOutput is l*m (row-major), weight is r*m (row-major); the unfolded
+    // gradient (l*r) is then added to the input frames
+    unfolded->resize(LongStorage{olen * batchSize, kw * inputPlanes});
+    blas::gemm(
+        CblasColMajor,
+        CblasTrans,
+        CblasNoTrans,
+        kw * inputPlanes, // r
+        olen * batchSize, // l
+        outputPlanes, // m
+        1, // alpha
+        W,
+        outputPlanes,
+        dO,
+        dOutput->stride(1),
+        0, // beta
+        unfolded->data(),
+        kw * inputPlanes
+        );
+    foldGradInput(*unfolded, *dInput, olen, g);
+    return 0;
+  }
   for (int k = 0; k < kw; k++) {
-    int iShift = std::max(0, k - pad);
-    int oShift = std::max(0, pad - k);
-    int t = std::min(ilen + pad - k, olen) - oShift;
     // dOutput * T(weight) -> dInput
     // Note: using gemm in column-major order mode
     // dOutput is l*m (row-major)
     // weight  is r*m (row-major)
     // dInput  is l*r (row-major)
-    if (t > 0)
+    forEachTapBlock(g, k, *dInput, *dOutput,
+                    [&](long oOff, long iOff, long l, long ldo, long ldi) {
       blas::gemm(
           CblasColMajor,
           CblasTrans,
           CblasNoTrans,
           inputPlanes, // r
-          batchSize * t, // l
+          l, // l
           outputPlanes, // m
           1, // alpha
           W + k * weight->stride(0),
           outputPlanes,
-          dO + oShift * dOutput->stride(0),
-          dOutput->stride(1),
+          dO + oOff,
+          ldo,
           1, // beta
-          dI + iShift * dInput->stride(0),
-          dInput->stride(1)
+          dI + iOff,
+          ldi
           );
+    });
   }
   return 0;
 }
@@ -154,49 +1002,121 @@ int accGradParameters(lua_State* L) {
   auto input = luaGetTensorChecked<T>(L, 2);
   auto dOutput = luaGetTensorChecked<T>(L, 3);
   T scale = luaGetNumberChecked<T>(L, 4);
+  bool residual;
+  auto activation = activationArg(L, 5, &residual);
+  bool ready = luaGetBoolean(L, 7).value_or(false);
+  convGradOutput<T>(L, activation, residual, ready, dOutput);
   auto ilen = input->size(0);
   auto batchSize = input->size(1);
   auto inputPlanes = input->size(2);
   auto outputPlanes = dOutput->size(2);
   auto olen = dOutput->size(0);
   auto kw = dWeight->size(0);
-  int pad = (olen - ilen + kw - 1) / 2;
+  auto g = geometryOf(L, kw, ilen, olen, batchSize);
 
   auto dW = dWeight->data();
   auto dB = dBias->data();
   auto I = input->data();
   auto dO = dOutput->data();
 
-  for (int t = 0; t < olen; t++)
-    for (int b = 0; b < batchSize; b++)
-      for (int c = 0; c < outputPlanes; c++)
-        dB[c] += dO[t * dOutput->stride(0) + b * dOutput->stride(1) + c];
+  for (long t = 0; t < olen; t++) {
+    for (long b = 0; b < batchSize; b++) {
+      if (t >= outputLength(g, b, olen)) {
+        continue;
+      }
+      const T* row = dO + t * dOutput->stride(0) + b * dOutput->stride(1);
+      #pragma omp simd
+      for (long c = 0; c < outputPlanes; c++) {
+        dB[c] += row[c];
+      }
+    }
+  }
 
+  if (strategy(L, g, *dWeight, *dOutput) == Strategy::kUnfolded) {
+    auto unfolded = luaGetFieldIfTensorChecked<T>(L, 1, "unfolded");
+    unfoldInput(*input, *unfolded, olen, g);
+    // unfolded input is m*l (row-major), dOutput is m*r (row-major)
+    blas::gemm(
+        CblasColMajor,
+        CblasNoTrans,
+        CblasTrans,
+        outputPlanes, // r
+        kw * inputPlanes, // l
+        olen * batchSize, // m
+        scale, // alpha
+        dO,
+        dOutput->stride(1),
+        unfolded->data(),
+        kw * inputPlanes,
+        1, // beta
+        dW,
+        outputPlanes
+        );
+    return 0;
+  }
   for (int k = 0; k < kw; k++) {
-    int iShift = std::max(0, k - pad);
-    int oShift = std::max(0, pad - k);
-    int t = std::min(ilen + pad - k, olen) - oShift;
     // Note: using gemm in column-major order mode
     // Input    is m*l (row-major)
     // dOutput  is m*r (row-major)
     // dWeight  is l*r (row-major)
-    if (t > 0)
+    forEachTapBlock(g, k, *input, *dOutput,
+                    [&](long oOff, long iOff, long m, long ldo, long ldi) {
       blas::gemm(
           CblasColMajor,
           CblasNoTrans,
           CblasTrans,
           outputPlanes, // r
           inputPlanes, // l
-          batchSize * t, // m
+          m, // m
           scale, // alpha
-          dO + oShift * dOutput->stride(0),
-          dOutput->stride(1),
-          I + iShift * input->stride(0),
-          input->stride(1),
+          dO + oOff,
+          ldo,
+          I + iOff,
+          ldi,
           1, // beta
           dW + k * dWeight->stride(0),
           outputPlanes
           );
+    });
+  }
+  return 0;
+}
+
+// Quantizes the weight into quantized_weight and weight_scales (one scale
+// per convolution plane, max |weight| / 127)
+template <class T>
+int quantize(lua_State* L) {
+  auto weight = luaGetFieldIfTensorChecked<T>(L, 1, "weight");
+  auto qWeight = luaGetFieldIfTensorChecked<unsigned char>(
+      L, 1, "quantized_weight");
+  auto scales = luaGetFieldIfTensorChecked<T>(L, 1, "weight_scales");
+  luaL_argcheck(L, weight->ndims() == 3, 1, "weight has wrong dimension");
+  long kw = weight->size(0);
+  long inputPlanes = weight->size(1);
+  long convPlanes = weight->size(2);
+  qWeight->resize(LongStorage{convPlanes, kw * inputPlanes});
+  scales->resize(LongStorage{convPlanes});
+  const T* W = weight->data();
+  #pragma omp parallel for
+  for (long o = 0; o < convPlanes; o++) {
+    auto at = [&](long k, long i) {
+      return W[k * weight->stride(0) + i * weight->stride(1) +
+               o * weight->stride(2)];
+    };
+    T maxAbs = 0;
+    for (long k = 0; k < kw; k++) {
+      for (long i = 0; i < inputPlanes; i++) {
+        maxAbs = std::max(maxAbs, std::abs(at(k, i)));
+      }
+    }
+    T scale = maxAbs > 0 ? maxAbs / 127 : 1;
+    scales->data()[o * scales->stride(0)] = scale;
+    int8_t* row = int8Data(*qWeight) + o * kw * inputPlanes;
+    for (long k = 0; k < kw; k++) {
+      for (long i = 0; i < inputPlanes; i++) {
+        row[k * inputPlanes + i] = quantizeValue(at(k, i), 1 / scale);
+      }
+    }
   }
   return 0;
 }
@@ -213,8 +1133,11 @@ class Registerer {
 template <class T>
 const luaL_Reg Registerer<T>::functions_[] = {
     {"TemporalConvolutionTBC_updateOutput", updateOutput<T>},
+    {"TemporalConvolutionTBC_updateOutputIncremental",
+     updateOutputIncremental<T>},
     {"TemporalConvolutionTBC_updateGradInput", updateGradInput<T>},
     {"TemporalConvolutionTBC_accGradParameters", accGradParameters<T>},
+    {"TemporalConvolutionTBC_quantize", quantize<T>},
     {nullptr, nullptr},
 };
 
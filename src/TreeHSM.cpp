@@ -0,0 +1,243 @@
+// Copyright 2004-present Facebook. All Rights Reserved.
+
+// Hierarchical softmax over a tree of arbitrary depth (see fbnn/TreeHSM.lua).
+// The children of each internal node own contiguous rows of `weight` and
+// `bias`, so a sample only scores the children of the internal nodes on the
+// path from its class to the root: O(depth x branching) per sample.
+
+#include <algorithm>
+#include <vector>
+
+#include <lua.hpp>
+#include <mkl.h>
+#include <luaT.h>
+#ifndef __clang__
+#include <omp.h>
+#endif
+
+#include "Blas.h"
+#include "Vml.h"
+
+#include "fblualib/LuaUtils.h"
+#include "thpp/Storage.h"
+#include "thpp/Tensor.h"
+
+namespace facebook {
+namespace deeplearning {
+namespace torch {
+
+using namespace fblualib;
+using namespace thpp;
+
+namespace {
+
+// Walks up the tree from the (1-based) class `itarget`. For each level, from
+// the bottom, stores the internal node (0 for the root) and the 0-based index
+// of the child taken in `parents` and `offsets`. Returns the depth.
+long pathToRoot(const Tensor<long>& tree, long n_classes, long itarget,
+                long* parents, long* offsets) {
+  long node = itarget - 1; // 1based->0based
+  long depth = 0;
+  while (true) {
+    long parent = tree.at({node, 0});
+    parents[depth] = parent;
+    offsets[depth] = tree.at({node, 1}) - 1; // 1based->0based
+    ++depth;
+    if (parent == 0)
+      return depth;
+    node = n_classes + parent - 1; // 1based->0based
+  }
+}
+
+template <class T>
+int updateOutput(lua_State* L) {
+  auto weight      = luaGetFieldIfTensorChecked<T>(L, 1, "weight");
+  auto bias        = luaGetFieldIfTensorChecked<T>(L, 1, "bias");
+  auto node_score  = luaGetFieldIfTensorChecked<T>(L, 1, "node_score");
+  auto node_logsum = luaGetFieldIfTensorChecked<T>(L, 1, "node_logsum");
+  auto tree        = luaGetFieldIfTensorChecked<long>(L, 1, "tree");
+  auto n_children  = luaGetFieldIfTensorChecked<long>(L, 1, "n_children");
+  auto child_start = luaGetFieldIfTensorChecked<long>(L, 1, "child_start");
+  auto n_classes   = luaGetFieldIfNumberChecked<long>(L, 1, "n_classes");
+  auto max_depth   = luaGetFieldIfNumberChecked<long>(L, 1, "max_depth");
+  auto input  = luaGetTensorChecked<T>(L, 2);
+  auto target = luaGetTensorChecked<long>(L, 3);
+  long input_size = weight->size(1);
+  long batch_size = input->size(0);
+  if (input->ndims() == 1)
+    batch_size = 1;
+  long input_stride = (input->ndims() == 1) ? 0 : input->stride(0);
+  long input_inc = input->stride(input->ndims() - 1);
+  long max_branching = node_score->size(2);
+
+  // per-sample losses, summed in a fixed order below
+  std::vector<T> sample_output(batch_size);
+#pragma omp parallel if (batch_size > 1)
+  {
+    std::vector<long> parents(max_depth), offsets(max_depth);
+    std::vector<T> work(max_branching);
+#pragma omp for
+    for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+      long depth = pathToRoot(*tree, n_classes, target->at({i_batch}),
+                              parents.data(), offsets.data());
+      const T* input_data = input->data() + i_batch * input_stride;
+      T loss = 0.;
+      for (long level = 0; level < depth; ++level) {
+        long parent = parents[level];
+        long n = n_children->at({parent});
+        long istart = child_start->at({parent});
+        T* score_data = node_score->data() + i_batch * node_score->stride(0) +
+          level * node_score->stride(1);
+        //   scores of the children of `parent`
+        blas::gemv(CblasRowMajor, CblasNoTrans, n, input_size,
+                   1, weight->data() + istart * weight->stride(0),
+                   weight->stride(0), input_data, input_inc,
+                   0, score_data, 1);
+        for (long d = 0; d < n; ++d)
+          score_data[d] += bias->at({istart + d});
+        T logsum = vml::logSumExp(n, score_data, work.data());
+        node_logsum->at({i_batch, level}) = logsum;
+        loss += logsum - score_data[offsets[level]];
+      }
+      sample_output[i_batch] = loss;
+    }
+  }
+  T output = 0.;
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch)
+    output += sample_output[i_batch];
+  lua_pushnumber(L, output);
+  return 1;
+}
+
+// Turns `node_score` into the gradient wrt the scores, and computes
+// gradInput.
+template <class T>
+int updateGradInput(lua_State* L) {
+  auto gradInput   = luaGetFieldIfTensorChecked<T>(L, 1, "gradInput");
+  auto weight      = luaGetFieldIfTensorChecked<T>(L, 1, "weight");
+  auto node_score  = luaGetFieldIfTensorChecked<T>(L, 1, "node_score");
+  auto node_logsum = luaGetFieldIfTensorChecked<T>(L, 1, "node_logsum");
+  auto tree        = luaGetFieldIfTensorChecked<long>(L, 1, "tree");
+  auto n_children  = luaGetFieldIfTensorChecked<long>(L, 1, "n_children");
+  auto child_start = luaGetFieldIfTensorChecked<long>(L, 1, "child_start");
+  auto n_classes   = luaGetFieldIfNumberChecked<long>(L, 1, "n_classes");
+  auto max_depth   = luaGetFieldIfNumberChecked<long>(L, 1, "max_depth");
+  auto target = luaGetTensorChecked<long>(L, 2);
+  long input_size = weight->size(1);
+  long batch_size = gradInput->size(0);
+  if (gradInput->ndims() == 1)
+    batch_size = 1;
+  long grad_stride = (gradInput->ndims() == 1) ? 0 : gradInput->stride(0);
+  long grad_inc = gradInput->stride(gradInput->ndims() - 1);
+
+#pragma omp parallel if (batch_size > 1)
+  {
+    std::vector<long> parents(max_depth), offsets(max_depth);
+#pragma omp for
+    for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+      long depth = pathToRoot(*tree, n_classes, target->at({i_batch}),
+                              parents.data(), offsets.data());
+      T* grad_data = gradInput->data() + i_batch * grad_stride;
+      for (long d = 0; d < input_size; ++d)
+        grad_data[d * grad_inc] = 0.;
+      for (long level = 0; level < depth; ++level) {
+        long parent = parents[level];
+        long n = n_children->at({parent});
+        long istart = child_start->at({parent});
+        T* score_data = node_score->data() + i_batch * node_score->stride(0) +
+          level * node_score->stride(1);
+        //   gradient of the log-softmax (into node_score)
+        vml::expShifted(n, score_data, node_logsum->at({i_batch, level}),
+                        score_data);
+        score_data[offsets[level]] -= 1.;
+        //   gradient of the linear part
+        blas::gemv(CblasRowMajor, CblasTrans, n, input_size,
+                   1, weight->data() + istart * weight->stride(0),
+                   weight->stride(0), score_data, 1,
+                   1, grad_data, grad_inc);
+      }
+    }
+  }
+  return 0;
+}
+
+// Accumulates scale * gradients into `grad_weight` and `grad_bias` (or, with
+// direct_update, into `weight` and `bias`). Samples are visited in batch
+// order, since different samples update the same rows near the root.
+template <class T>
+int accGradParameters(lua_State* L) {
+  auto node_score  = luaGetFieldIfTensorChecked<T>(L, 1, "node_score");
+  auto tree        = luaGetFieldIfTensorChecked<long>(L, 1, "tree");
+  auto n_children  = luaGetFieldIfTensorChecked<long>(L, 1, "n_children");
+  auto child_start = luaGetFieldIfTensorChecked<long>(L, 1, "child_start");
+  auto n_classes   = luaGetFieldIfNumberChecked<long>(L, 1, "n_classes");
+  auto max_depth   = luaGetFieldIfNumberChecked<long>(L, 1, "max_depth");
+  auto input  = luaGetTensorChecked<T>(L, 2);
+  auto target = luaGetTensorChecked<long>(L, 3);
+  T scale = luaGetNumberChecked<T>(L, 4);
+  bool direct_update = luaGetBoolean(L, 5).value_or(false);
+  auto grad_weight = luaGetFieldIfTensorChecked<T>(
+    L, 1, direct_update ? "weight" : "grad_weight");
+  auto grad_bias = luaGetFieldIfTensorChecked<T>(
+    L, 1, direct_update ? "bias" : "grad_bias");
+  long input_size = grad_weight->size(1);
+  long batch_size = input->size(0);
+  if (input->ndims() == 1)
+    batch_size = 1;
+  long input_stride = (input->ndims() == 1) ? 0 : input->stride(0);
+  long input_inc = input->stride(input->ndims() - 1);
+
+  std::vector<long> parents(max_depth), offsets(max_depth);
+  for (long i_batch = 0; i_batch < batch_size; ++i_batch) {
+    long depth = pathToRoot(*tree, n_classes, target->at({i_batch}),
+                            parents.data(), offsets.data());
+    const T* input_data = input->data() + i_batch * input_stride;
+    for (long level = 0; level < depth; ++level) {
+      long parent = parents[level];
+      long n = n_children->at({parent});
+      long istart = child_start->at({parent});
+      const T* score_data = node_score->data() +
+        i_batch * node_score->stride(0) + level * node_score->stride(1);
+      blas::ger(CblasRowMajor, n, input_size, scale, score_data, 1,
+                input_data, input_inc,
+                grad_weight->data() + istart * grad_weight->stride(0),
+                grad_weight->stride(0));
+      blas::axpy(n, scale, score_data, 1,
+                 grad_bias->data() + istart * grad_bias->stride(0),
+                 grad_bias->stride(0));
+    }
+  }
+  return 0;
+}
+
+template <class T>
+class Registerer {
+ private:
+  static const luaL_Reg functions_[];
+public:
+  static void registerFunctions(lua_State* L);
+};
+
+template <class T>
+const luaL_Reg Registerer<T>::functions_[] = {
+  {"TreeHSM_updateOutput"     , updateOutput<T>},
+  {"TreeHSM_updateGradInput"  , updateGradInput<T>},
+  {"TreeHSM_accGradParameters", accGradParameters<T>},
+  {nullptr, nullptr},
+};
+
+template <class T>
+void Registerer<T>::registerFunctions(lua_State* L) {
+  luaT_pushmetatable(L, Tensor<T>::kLuaTypeName);
+  luaT_registeratname(L, functions_, "nn");
+  lua_pop(L, 1);
+}
+
+} // namespace
+
+void initTreeHSM(lua_State* L) {
+  Registerer<float>::registerFunctions(L);
+  Registerer<double>::registerFunctions(L);
+}
+
+}}} // namespaces
@@ -0,0 +1,361 @@
+// Copyright 2004-present Facebook. All Rights Reserved.
+
+// Tensor formats
+// Input: batchSize * ilen * inputPlanes (contiguous)
+// Output: batchSize * olen * outputPlanes, olen = ilen + 2 * pad - kw + 1
+// Weight: outputPlanes * (kw * inputPlanes), as the nn.Linear applied to
+// the unfolded input (column k * inputPlanes + i reads input plane i of
+// frame t - pad + k)
+//
+// The unfolded input (a row of kw frames per output frame) is never
+// materialized for the whole batch: each pass unfolds tiles of tile_rows
+// output frames (kDefaultTileRows by default) into the `unfolded_tile`
+// buffer, straight from the input with zeros out of range, and runs one
+// gemm per tile. The memory is kw * inputPlanes * tile_rows instead of
+// kw times the input.
+
+#include <lua.hpp>
+#include <luaT.h>
+#include <mkl.h>
+#include <algorithm>
+#include <cstring>
+#include "Blas.h"
+#include "fblualib/LuaUtils.h"
+#include "thpp/Storage.h"
+#include "thpp/Tensor.h"
+
+namespace facebook {
+namespace deeplearning {
+namespace torch {
+
+using namespace fblualib;
+using namespace thpp;
+
+namespace {
+
+const long kDefaultTileRows = 256;
+
+struct Sizes {
+  long batchSize;
+  long ilen;
+  long olen;
+  long inputPlanes;
+  long outputPlanes;
+  long kw;
+  long pad;
+  long tileRows;
+};
+
+// Checks the input (batchSize * ilen * inputPlanes, contiguous) and the
+// weight, and returns the sizes
+template <class T>
+Sizes checkedSizes(
+    lua_State* L,
+    const Tensor<T>& input,
+    const Tensor<T>& weight) {
+  luaL_argcheck(
+      L,
+      input.ndims() == 3 && input.isContiguous(),
+      2,
+      "input must be a contiguous 3d tensor");
+  Sizes s;
+  s.batchSize = input.size(0);
+  s.ilen = input.size(1);
+  s.inputPlanes = input.size(2);
+  s.kw = luaGetFieldIfNumber<long>(L, 1, "kW").value_or(0);
+  s.pad = luaGetFieldIfNumber<long>(L, 1, "pad").value_or(0);
+  s.tileRows = luaGetFieldIfNumber<long>(L, 1, "tile_rows")
+                   .value_or(kDefaultTileRows);
+  luaL_argcheck(L, s.kw >= 1, 1, "invalid kernel width");
+  luaL_argcheck(L, s.tileRows >= 1, 1, "tile_rows must be positive");
+  luaL_argcheck(
+      L,
+      weight.ndims() == 2 && weight.size(1) == s.kw * s.inputPlanes &&
+          weight.stride(1) == 1,
+      1,
+      "weight has wrong dimension");
+  s.outputPlanes = weight.size(0);
+  s.olen = s.ilen + 2 * s.pad - s.kw + 1;
+  luaL_argcheck(L, s.olen >= 1, 2, "input is too short");
+  return s;
+}
+
+// Writes the rows first .. first + rows - 1 of the unfolded input (row
+// b * olen + t holds the input frames t - pad .. t - pad + kw - 1 of batch
+// element b, zeros out of range)
+template <class T>
+void unfoldTile(
+    const Sizes& s,
+    const T* input,
+    long first,
+    long rows,
+    T* tile) {
+  long width = s.kw * s.inputPlanes;
+  #pragma omp parallel for if (rows * width > 100000)
+  for (long r = 0; r < rows; r++) {
+    long b = (first + r) / s.olen;
+    long t = (first + r) % s.olen;
+    T* row = tile + r * width;
+    for (long k = 0; k < s.kw; k++) {
+      long frame = t - s.pad + k;
+      T* dst = row + k * s.inputPlanes;
+      if (frame < 0 || frame >= s.ilen) {
+        std::fill(dst, dst + s.inputPlanes, T(0));
+      } else {
+        const T* src = input + (b * s.ilen + frame) * s.inputPlanes;
+        std::copy(src, src + s.inputPlanes, dst);
+      }
+    }
+  }
+}
+
+// Adds the rows first .. first + rows - 1 of the unfolded gradient to the
+// input frames they come from. Rows of different output frames reach the
+// same input frame, so the rows of each batch element are added in order
+// (the batch elements in parallel).
+template <class T>
+void foldTile(
+    const Sizes& s,
+    const T* tile,
+    long first,
+    long rows,
+    T* dInput) {
+  long width = s.kw * s.inputPlanes;
+  long firstBatch = first / s.olen;
+  long lastBatch = (first + rows - 1) / s.olen;
+  #pragma omp parallel for if (rows * width > 100000)
+  for (long b = firstBatch; b <= lastBatch; b++) {
+    long begin = std::max(first, b * s.olen);
+    long end = std::min(first + rows, (b + 1) * s.olen);
+    for (long r = begin; r < end; r++) {
+      long t = r - b * s.olen;
+      const T* row = tile + (r - first) * width;
+      for (long k = 0; k < s.kw; k++) {
+        long frame = t - s.pad + k;
+        if (frame < 0 || frame >= s.ilen) {
+          continue;
+        }
+        const T* src = row + k * s.inputPlanes;
+        T* dst = dInput + (b * s.ilen + frame) * s.inputPlanes;
+        #pragma omp simd
+        for (long i = 0; i < s.inputPlanes; i++) {
+          dst[i] += src[i];
+        }
+      }
+    }
+  }
+}
+
+// Calls f(first row, rows, tile) for the tiles of the unfolded input
+template <class T, class F>
+void forEachTile(
+    lua_State* L,
+    const Sizes& s,
+    const T* input,
+    bool unfold,
+    F f) {
+  auto tile = luaGetFieldIfTensorChecked<T>(L, 1, "unfolded_tile");
+  long total = s.batchSize * s.olen;
+  long tileRows = std::min(s.tileRows, total);
+  tile->resize(LongStorage{tileRows, s.kw * s.inputPlanes});
+  for (long first = 0; first < total; first += tileRows) {
+    long rows = std::min(tileRows, total - first);
+    if (unfold) {
+      unfoldTile(s, input, first, rows, tile->data());
+    }
+    f(first, rows, tile->data());
+  }
+}
+
+template <class T>
+int updateOutput(lua_State* L) {
+  auto output = luaGetFieldIfTensorChecked<T>(L, 1, "output");
+  auto weight = luaGetFieldIfTensorChecked<T>(L, 1, "weight");
+  auto bias = luaGetFieldIfTensor<T>(L, 1, "bias");
+  auto input = luaGetTensorChecked<T>(L, 2);
+  auto s = checkedSizes(L, *input, *weight);
+  luaL_argcheck(
+      L,
+      !bias || (*bias)->size() == s.outputPlanes,
+      1,
+      "bias has wrong dimension");
+  output->resize(LongStorage{s.batchSize, s.olen, s.outputPlanes});
+
+  auto O = output->data();
+  long total = s.batchSize * s.olen;
+  if (bias) {
+    const T* B = (*bias)->data();
+    long stride = (*bias)->stride(0);
+    for (long r = 0; r < total; r++) {
+      T* row = O + r * s.outputPlanes;
+      for (long o = 0; o < s.outputPlanes; o++) {
+        row[o] = B[o * stride];
+      }
+    }
+  } else {
+    std::fill(O, O + total * s.outputPlanes, T(0));
+  }
+
+  long width = s.kw * s.inputPlanes;
+  forEachTile(L, s, input->data(), true,
+              [&](long first, long rows, const T* tile) {
+    // Note: using gemm in column-major order mode
+    // tile    is rows*width (row-major)
+    // weight  is outputPlanes*width (row-major)
+    // output  is rows*outputPlanes (row-major)
+    blas::gemm(
+        CblasColMajor,
+        CblasTrans,
+        CblasNoTrans,
+        s.outputPlanes,
+        rows,
+        width,
+        T(1), // alpha
+        weight->data(),
+        weight->stride(0),
+        tile,
+        width,
+        T(1), // beta
+        O + first * s.outputPlanes,
+        s.outputPlanes
+        );
+  });
+  return 0;
+}
+
+template <class T>
+int updateGradInput(lua_State* L) {
+  auto dInput = luaGetFieldIfTensorChecked<T>(L, 1, "gradInput");
+  auto weight = luaGetFieldIfTensorChecked<T>(L, 1, "weight");
+  auto input = luaGetTensorChecked<T>(L, 2);
+  auto dOutput = luaGetTensorChecked<T>(L, 3);
+  auto s = checkedSizes(L, *input, *weight);
+  luaL_argcheck(
+      L,
+      dOutput->ndims() == 3 && dOutput->isContiguous() &&
+          dOutput->size(0) == s.batchSize && dOutput->size(1) == s.olen &&
+          dOutput->size(2) == s.outputPlanes,
+      3,
+      "gradOutput has wrong dimension or is not contiguous");
+  dInput->resizeAs(*input);
+  dInput->fill(0);
+
+  long width = s.kw * s.inputPlanes;
+  auto dO = dOutput->data();
+  auto dI = dInput->data();
+  forEachTile(L, s, input->data(), false,
+              [&](long first, long rows, T* tile) {
+    // Note: using gemm in column-major order mode
+    // dOutput is rows*outputPlanes (row-major)
+    // weight  is outputPlanes*width (row-major)
+    // tile    is rows*width (row-major), the unfolded gradient
+    blas::gemm(
+        CblasColMajor,
+        CblasNoTrans,
+        CblasNoTrans,
+        width,
+        rows,
+        s.outputPlanes,
+        T(1), // alpha
+        weight->data(),
+        weight->stride(0),
+        dO + first * s.outputPlanes,
+        s.outputPlanes,
+        T(0), // beta
+        tile,
+        width
+        );
+    foldTile(s, tile, first, rows, dI);
+  });
+  return 0;
+}
+
+template <class T>
+int accGradParameters(lua_State* L) {
+  auto dWeight = luaGetFieldIfTensorChecked<T>(L, 1, "gradWeight");
+  auto dBias = luaGetFieldIfTensor<T>(L, 1, "gradBias");
+  auto input = luaGetTensorChecked<T>(L, 2);
+  auto dOutput = luaGetTensorChecked<T>(L, 3);
+  T scale = luaGetNumberChecked<T>(L, 4);
+  auto s = checkedSizes(L, *input, *dWeight);
+  luaL_argcheck(
+      L,
+      dOutput->ndims() == 3 && dOutput->isContiguous() &&
+          dOutput->size(0) == s.batchSize && dOutput->size(1) == s.olen &&
+          dOutput->size(2) == s.outputPlanes,
+      3,
+      "gradOutput has wrong dimension or is not contiguous");
+
+  auto dO = dOutput->data();
+  long total = s.batchSize * s.olen;
+  if (dBias) {
+    T* dB = (*dBias)->data();
+    long stride = (*dBias)->stride(0);
+    for (long r = 0; r < total; r++) {
+      const T* row = dO + r * s.outputPlanes;
+      for (long o = 0; o < s.outputPlanes; o++) {
+        dB[o * stride] += scale * row[o];
+      }
+    }
+  }
+
+  long width = s.kw * s.inputPlanes;
+  forEachTile(L, s, input->data(), true,
+              [&](long first, long rows, const T* tile) {
+    // Note: using gemm in column-major order mode
+    // tile    is rows*width (row-major)
+    // dOutput is rows*outputPlanes (row-major)
+    // dWeight is outputPlanes*width (row-major)
+    blas::gemm(
+        CblasColMajor,
+        CblasNoTrans,
+        CblasTrans,
+        width,
+        s.outputPlanes,
+        rows,
+        scale, // alpha
+        tile,
+        width,
+        dO + first * s.outputPlanes,
+        s.outputPlanes,
+        T(1), // beta
+        dWeight->data(),
+        dWeight->stride(0)
+        );
+  });
+  return 0;
+}
+
+template <class T>
+class Registerer {
+ private:
+  static const luaL_Reg functions_[];
+
+ public:
+  static void registerFunctions(lua_State* L);
+};
+
+template <class T>
+const luaL_Reg Registerer<T>::functions_[] = {
+    {"UnfoldedTemporalConvolution_updateOutput", updateOutput<T>},
+    {"UnfoldedTemporalConvolution_updateGradInput", updateGradInput<T>},
+    {"UnfoldedTemporalConvolution_accGradParameters", accGradParameters<T>},
+    {nullptr, nullptr},
+};
+
+template <class T>
+void Registerer<T>::registerFunctions(lua_State* L) {
+  luaT_pushmetatable(L, Tensor<T>::kLuaTypeName);
+  luaT_registeratname(L, functions_, "nn");
+  lua_pop(L, 1);
+}
+
+} // namespace
+
+void initUnfoldedTemporalConvolution(lua_State* L) {
+  Registerer<float>::registerFunctions(L);
+  Registerer<double>::registerFunctions(L);
+}
+}
+}
+}
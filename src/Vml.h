@@ -6,6 +6,10 @@
 #ifndef DEEPLEARNING_TORCH_VML_H_
 #define DEEPLEARNING_TORCH_VML_H_
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
 #include <mkl.h>
 #include <folly/Preprocessor.h>
 
@@ -102,6 +106,85 @@ DEFINE_OPS(double, vd)
 #undef XI
 #undef XO
 
+// Row-wise softmax primitives on n contiguous elements, built on the
+// vectorized exp above.
+
+// Returns log(sum_i exp(x[i])), -inf if n == 0. `work` is a scratch buffer
+// of n elements.
+template <class T>
+T logSumExp(long n, const T* x, T* work) {
+  if (n == 0)
+    return -std::numeric_limits<T>::infinity();
+  T maxInput = *std::max_element(x, x + n);
+  if (std::isinf(maxInput))  // all -inf, or some +inf
+    return maxInput;
+  for (long i = 0; i < n; ++i)
+    work[i] = x[i] - maxInput;
+  exp(n, work, work);
+  double sum = 0.;
+  for (long i = 0; i < n; ++i)
+    sum += work[i];
+  return maxInput + std::log(sum);
+}
+
+// y[i] = exp(x[i] - shift). y may be x.
+template <class T>
+void expShifted(long n, const T* x, T shift, T* y) {
+  for (long i = 0; i < n; ++i)
+    y[i] = x[i] - shift;
+  exp(n, y, y);
+}
+
+// y = softmax(x), returns the log-sum-exp of x (-inf if n == 0). y may be x.
+template <class T>
+T softMax(long n, const T* x, T* y) {
+  if (n == 0)
+    return -std::numeric_limits<T>::infinity();
+  T maxInput = *std::max_element(x, x + n);
+  expShifted(n, x, maxInput, y);
+  double sum = 0.;
+  for (long i = 0; i < n; ++i)
+    sum += y[i];
+  T scale = 1. / sum;
+  for (long i = 0; i < n; ++i)
+    y[i] *= scale;
+  return maxInput + std::log(sum);
+}
+
+// y = log_softmax(x), returns the log-sum-exp of x. y may be x. `work` is a
+// scratch buffer of n elements.
+template <class T>
+T logSoftMax(long n, const T* x, T* y, T* work) {
+  T logsum = logSumExp(n, x, work);
+  for (long i = 0; i < n; ++i)
+    y[i] = x[i] - logsum;
+  return logsum;
+}
+
+// Gradient of softmax given its output y and the gradient gy wrt y:
+// gx[i] = y[i] * (gy[i] - sum_j gy[j] y[j]). gx may be y or gy.
+template <class T>
+void softMaxBackward(long n, const T* y, const T* gy, T* gx) {
+  double dot = 0.;
+  for (long i = 0; i < n; ++i)
+    dot += gy[i] * y[i];
+  for (long i = 0; i < n; ++i)
+    gx[i] = y[i] * (gy[i] - dot);
+}
+
+// Gradient of log_softmax given its output y and the gradient gy wrt y:
+// gx[i] = gy[i] - exp(y[i]) * sum_j gy[j]. gx may be y or gy. `work` is a
+// scratch buffer of n elements.
+template <class T>
+void logSoftMaxBackward(long n, const T* y, const T* gy, T* gx, T* work) {
+  double sum = 0.;
+  for (long i = 0; i < n; ++i)
+    sum += gy[i];
+  exp(n, y, work);
+  for (long i = 0; i < n; ++i)
+    gx[i] = gy[i] - work[i] * sum;
+}
+
 }}}}  // namespaces
 
 #endif /* DEEPLEARNING_TORCH_VML_H_ */
@@ -0,0 +1,52 @@
+-- Copyright 2004-present Facebook. All Rights Reserved.
+
+-- Micro-benchmark of the native row-wise log-sum-exp and softmax
+-- (LogSumExp_rows / LogSumExp_expShiftedRows) against the tensor-op Lua
+-- code the SoftPlusLSE criteria used before.
+--
+-- Usage: th benchmark_logsumexp.lua [batch_size] [n_iter]
+
+require 'nn'
+require 'fbnn'
+
+torch.setdefaulttensortype('torch.FloatTensor')
+
+local batch_size = tonumber(arg[1]) or 64
+local n_iter = tonumber(arg[2]) or 20
+
+local function luaLogSumExp(input)
+    local max_val = torch.max(input, 2)
+    local lse = (input - max_val:expand(input:size())):exp():sum(2):log()
+    lse:add(max_val)
+    return torch.exp(input - lse:expand(input:size()))
+end
+
+local function nativeLogSumExp(input, lse, softmax)
+    input.nn.LogSumExp_rows(lse, input)
+    input.nn.LogSumExp_expShiftedRows(softmax, input, lse)
+    return softmax
+end
+
+local function time(f)
+    f()
+    local timer = torch.Timer()
+    for i = 1, n_iter do
+        f()
+    end
+    return timer:time().real / n_iter * 1000
+end
+
+print(string.format('%8s %12s %12s %8s', 'width', 'lua (ms)', 'native (ms)',
+                    'speedup'))
+for _, width in ipairs{100, 1000, 10000, 50000} do
+    local input = torch.randn(batch_size, width)
+    local lse, softmax = torch.Tensor(), torch.Tensor()
+    local t_lua = time(function() luaLogSumExp(input) end)
+    local t_native = time(function()
+        nativeLogSumExp(input, lse, softmax)
+    end)
+    local err = (softmax - luaLogSumExp(input)):abs():max()
+    assert(err < 1e-5, 'native and Lua results differ by ' .. err)
+    print(string.format('%8d %12.3f %12.3f %7.1fx', width, t_lua, t_native,
+                        t_lua / t_native))
+end
@@ -0,0 +1,56 @@
+-- Copyright 2004-present Facebook. All Rights Reserved.
+
+-- Training step (forward, backward and update) of nn.HSM against
+-- nn.SampledSoftMax on the same Zipfian vocabulary, to pick the cheaper
+-- criterion for a model. The HSM mapping is built with HSM.buildMapping.
+--
+-- Usage: th benchmark_sampled_softmax.lua [input_size] [batch_size]
+--                                         [n_samples] [n_iter]
+
+require 'nn'
+require 'fbnn'
+
+torch.setdefaulttensortype('torch.FloatTensor')
+
+local input_size = tonumber(arg[1]) or 256
+local batch_size = tonumber(arg[2]) or 128
+local n_samples = tonumber(arg[3]) or 1024
+local n_iter = tonumber(arg[4]) or 20
+
+local function time(f)
+    f()
+    local timer = torch.Timer()
+    for i = 1, n_iter do
+        f()
+    end
+    return timer:time().real / n_iter * 1000
+end
+
+local function step(crit, input, target)
+    crit:zeroGradParameters()
+    crit:updateOutput(input, target)
+    crit:updateGradInput(input, target)
+    crit:accGradParameters(input, target, 1)
+    crit:updateParameters(0.1)
+end
+
+print(string.format('%9s %12s %14s %14s', 'n_classes', 'hsm (ms)',
+                    'sampled (ms)', 'nce (ms)'))
+for _, n_classes in ipairs{10000, 100000, 500000} do
+    -- Zipfian class frequencies, most frequent class first
+    local freqs = torch.range(1, n_classes):pow(-1)
+    local input = torch.randn(batch_size, input_size)
+    local target = torch.multinomial(freqs, batch_size, true)
+
+    local mapping = nn.HSM.buildMapping(freqs)
+    local hsm = nn.HSM(mapping, input_size):sparseClassGrad()
+    local sampled = nn.SampledSoftMax(n_classes, input_size, n_samples)
+    local nce = nn.SampledSoftMax(n_classes, input_size, n_samples)
+    nce.nce = true
+
+    local t_hsm = time(function() step(hsm, input, target) end)
+    local t_sampled = time(function() step(sampled, input, target) end)
+    local t_nce = time(function() step(nce, input, target) end)
+    print(string.format('%9d %12.3f %14.3f %14.3f', n_classes, t_hsm,
+                        t_sampled, t_nce))
+end